@@ -35,11 +35,14 @@ public class Portals : ModuleRules
 			new string[]
 			{
 				"CoreUObject",
+				"DeveloperSettings",
 				"Engine",
 				"Slate",
                 "SlateCore",
                 "EngineSettings",
-				"InputCore"
+				"InputCore",
+				"RHI",
+				"RenderCore"
 				// ... add private dependencies that you statically link with here ...	
 			}
 			);
@@ -2,13 +2,21 @@
 
 #include "CustomPortal.h"
 
+#include <HAL/IConsoleManager.h>
+
 #include "PortalSceneCapture.h"
 
 
+static TAutoConsoleVariable<float> CVarPortalCompositeLowResolutionWeight(
+   TEXT("r.Portals.Composite.LowResolutionWeight"),
+   0.2f,
+   TEXT("Fraction of the total weight under which a capture of a composited portal is rendered in half resolution."),
+   ECVF_Scalability);
+
+
 ACustomPortal::ACustomPortal(const FObjectInitializer& ObjectInitializer) :
    Super(ObjectInitializer)
 {
-   PrimaryActorTick.bCanEverTick = true;
 }
 
 
@@ -24,7 +32,40 @@ void ACustomPortal::SetSceneCaptures()
 
 void ACustomPortal::AddSceneCapture(UPortalSceneCapture* scene_capture)
 {
-   // Maximum 5 scene captures supported
-   if (m_scene_captures.Num() < 5)
-      m_scene_captures.Add(scene_capture);
+   // Past the textures the material takes, the captures are composited
+   m_scene_captures.Add(scene_capture);
+}
+
+
+bool ACustomPortal::IsSceneCaptureSkipped(int32 scene_capture_index) const
+{
+   return ShouldCompositeCaptures() && GetNormalizedWeight(scene_capture_index) < GetMinCompositeWeight();
+}
+
+
+float ACustomPortal::GetSceneCaptureResolutionScale(int32 scene_capture_index) const
+{
+   if (!ShouldCompositeCaptures())
+      return 1.f;
+
+   return GetNormalizedWeight(scene_capture_index) < CVarPortalCompositeLowResolutionWeight.GetValueOnGameThread() ? 0.5f : 1.f;
+}
+
+
+bool ACustomPortal::ShouldCompositeCaptures() const
+{
+   return m_composite_captures || Super::ShouldCompositeCaptures();
+}
+
+
+float ACustomPortal::GetNormalizedWeight(int32 scene_capture_index) const
+{
+   if (!m_scene_captures.IsValidIndex(scene_capture_index))
+      return 0.f;
+
+   float total_weight = 0.f;
+   for (const UPortalSceneCapture* scene_capture : m_scene_captures)
+      total_weight += FMath::Max(scene_capture->getWeight(), 0.f);
+
+   return total_weight > 0.f ? FMath::Max(m_scene_captures[scene_capture_index]->getWeight(), 0.f) / total_weight : 0.f;
 }
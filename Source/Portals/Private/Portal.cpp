@@ -2,233 +2,691 @@
 
 #include "Portal.h"
 
-#include <utility> /* std::move */
 #include <Components/ActorComponent.h>
+#include <Engine/Canvas.h>
+#include <Engine/StaticMesh.h>
+#include <Engine/StaticMeshSocket.h>
 #include <Engine/TextureRenderTarget2D.h>
-#include <Runtime/Engine/Public/EngineUtils.h>
+#include <GameFramework/PlayerController.h>
+#include <HAL/IConsoleManager.h>
+#include <Kismet/KismetRenderingLibrary.h>
+#include <Materials/MaterialInstanceDynamic.h>
 
+#include "PortalGameModeBase.h"
+#include "PortalManager.h"
 #include "PortalTools.h"
+#include "PortalQualitySettings.h"
+#include "PortalRenderTargetPool.h"
 #include "PortalSceneCapture.h"
+#include "PortalStats.h"
 
 
-FTextureToRender::FTextureToRender(FTextureToRender&& other) noexcept
+static TAutoConsoleVariable<int32> CVarPortalMaxRenderDepth(
+   TEXT("r.Portals.MaxRenderDepth"),
+   -1,
+   TEXT("Number of portals that can be seen through each other. Negative to use the project settings."),
+   ECVF_Scalability);
+
+static TAutoConsoleVariable<int32> CVarPortalActiveDistance(
+   TEXT("r.Portals.ActiveDistance"),
+   -1,
+   TEXT("Distance in cm from the camera beyond which portals are never rendered. Negative to use the project settings."),
+   ECVF_Scalability);
+
+static TAutoConsoleVariable<float> CVarPortalCompositeMinWeight(
+   TEXT("r.Portals.Composite.MinWeight"),
+   0.02f,
+   TEXT("Fraction of the total weight under which a capture of a composited portal is neither captured nor blended."),
+   ECVF_Scalability);
+
+
+// Sets default values
+APortal::APortal(const FObjectInitializer& ObjectInitializer) :
+   Super(ObjectInitializer),
+   m_is_active(false),
+   m_portal_manager(nullptr)
+{
+   // Portals are updated by the manager, designers can still opt in with Start with Tick Enabled for Blueprint ticks
+   PrimaryActorTick.bCanEverTick = true;
+   PrimaryActorTick.bStartWithTickEnabled = false;
+
+   RootComponent = CreateDefaultSubobject<USceneComponent>(TEXT("RootComponent"));
+   RootComponent->Mobility = EComponentMobility::Static;
+
+   m_portal_mesh = CreateDefaultSubobject<UStaticMeshComponent>(TEXT("PortalMesh"));
+   m_portal_mesh->AttachToComponent(RootComponent, FAttachmentTransformRules(EAttachmentRule::KeepRelative, false));
+}
+
+
+void APortal::BeginPlay()
 {
-   texture = other.texture;
-   is_mirror = other.is_mirror;
-   weight = other.weight;
+   Super::BeginPlay();
+
+   LoadMeshVertices();
+
+   // Static portals never move, they don't need to be notified
+   if (m_is_movable && m_portal_mesh)
+      m_portal_mesh->TransformUpdated.AddUObject(this, &APortal::OnPortalTransformUpdated);
+
+   // Portals spawned after the manager initialization have to register themselves
+   APortalGameModeBase* game_mode = GetWorld()->GetAuthGameMode<APortalGameModeBase>();
 
-   other.texture = nullptr;
-   other.is_mirror = false;
-   other.weight = 0.f;
+   if (game_mode && game_mode->GetPortalManager())
+      game_mode->GetPortalManager()->RegisterPortal(this);
 }
 
-FTextureToRender::FTextureToRender(const FTextureToRender& other) noexcept
+
+void APortal::OnConstruction(const FTransform& Transform)
 {
-   texture = other.texture;
-   is_mirror = other.is_mirror;
-   weight = other.weight;
+   Super::OnConstruction(Transform);
+
+   const EComponentMobility::Type mobility = m_is_movable ? EComponentMobility::Movable : EComponentMobility::Static;
+
+   RootComponent->SetMobility(mobility);
+   m_portal_mesh->SetMobility(mobility);
 }
 
-FTextureToRender& FTextureToRender::operator=(FTextureToRender&& other) noexcept
+
+void APortal::EndPlay(const EEndPlayReason::Type EndPlayReason)
 {
-   if (this != &other)
-   {
-      delete texture;
+   if (m_portal_mesh)
+      m_portal_mesh->TransformUpdated.RemoveAll(this);
+
+   if (IsValid(m_portal_manager))
+      m_portal_manager->UnregisterPortal(this);
 
-      texture = other.texture;
-      is_mirror = other.is_mirror;
-      weight = other.weight;
+   m_portal_manager = nullptr;
 
-      other.texture = nullptr;
-      other.is_mirror = false;
-      other.weight = 0.f;
+   if (UPortalRenderTargetPool* render_target_pool = GetWorld() ? GetWorld()->GetSubsystem<UPortalRenderTargetPool>() : nullptr)
+   {
+      for (UTextureRenderTarget2D* render_target : m_composite_render_targets)
+      {
+         if (render_target)
+            render_target_pool->ReleaseRenderTarget(render_target);
+      }
    }
 
-   return *this;
+   m_composite_render_targets.Empty();
+   m_composite_states.Empty();
+
+   Super::EndPlay(EndPlayReason);
 }
 
-FTextureToRender& FTextureToRender::operator=(const FTextureToRender& other) noexcept
+
+void APortal::LoadMeshVertices() const
 {
-   if (this != &other)
-   {
-      delete texture;
+   m_local_vertices.Empty(9);
+
+   m_local_middle_point = FVector::ZeroVector;
+
+   if (!IsValidLowLevel()) return;
+   if (!m_portal_mesh) return;
+   if (!m_portal_mesh->GetStaticMesh()) return;
+
+   const UStaticMesh* static_mesh = m_portal_mesh->GetStaticMesh();
+
+   // Local bounds of the mesh, thus oriented with the portal once transformed
+   const FBox local_bounds = static_mesh->GetBoundingBox();
 
-      texture = other.texture;
-      is_mirror = other.is_mirror;
-      weight = other.weight;
+   m_local_middle_point = local_bounds.GetCenter();
+
+   // Points authored as sockets replace the computed ones
+   for (const UStaticMeshSocket* socket : static_mesh->Sockets)
+   {
+      if (socket && socket->SocketName.ToString().StartsWith(m_VISIBILITY_SOCKET_PREFIX))
+         m_local_vertices.Add(socket->RelativeLocation);
    }
 
-   return *this;
+   if (m_local_vertices.Num() == 0)
+      ComputeVisibilitySamples(local_bounds, m_visibility_samples_per_side, m_local_vertices);
+
+   UpdateWorldSpaceCache();
 }
 
 
-// Sets default values
-APortal::APortal(const FObjectInitializer& ObjectInitializer) :
-   Super(ObjectInitializer),
-   m_is_active(false)
+void APortal::UpdateWorldSpaceCache() const
 {
-   PrimaryActorTick.bCanEverTick = true;
+   m_portal_plane = FPlane(GetActorLocation(), GetActorForwardVector());
 
-   m_is_renderer_but_not_captured = false;
+   if (m_portal_mesh)
+   {
+      const FTransform& mesh_transform = m_portal_mesh->GetComponentTransform();
 
-   RootComponent = CreateDefaultSubobject<USceneComponent>(TEXT("RootComponent"));
-   RootComponent->Mobility = EComponentMobility::Static;
+      m_vertices.Reset(m_local_vertices.Num());
 
-   m_portal_mesh = CreateDefaultSubobject<UStaticMeshComponent>(TEXT("PortalMesh"));
-   m_portal_mesh->AttachToComponent(RootComponent, FAttachmentTransformRules(EAttachmentRule::KeepRelative, false));
+      for (const FVector& local_vertex : m_local_vertices)
+         m_vertices.Add(mesh_transform.TransformPosition(local_vertex));
+
+      m_middle_point = mesh_transform.TransformPosition(m_local_middle_point);
+   }
+
+   m_is_world_space_cache_valid = true;
 }
 
 
-void APortal::BeginPlay()
+void APortal::OnPortalTransformUpdated(USceneComponent* updated_component, EUpdateTransformFlags update_transform_flags, ETeleportType teleport)
 {
-   Super::BeginPlay();
+   // Only recomputed once needed
+   m_is_world_space_cache_valid = false;
 
-   LoadMeshVertices();
+   if (m_portal_manager)
+      m_portal_manager->NotifyPortalMoved(this);
 }
 
 
-void APortal::LoadMeshVertices() const
+void APortal::ComputeVisibilitySamples(const FBox& bounds, int32 samples_per_side, TArray<FVector>& OUT_samples)
 {
-   m_vertices.Empty(4);
+   // Corners, a flat mesh only has 4 distinct ones
+   for (int32 corner_index = 0; corner_index < 8; ++corner_index)
+   {
+      OUT_samples.AddUnique(FVector((corner_index & 1) ? bounds.Max.X : bounds.Min.X,
+                                    (corner_index & 2) ? bounds.Max.Y : bounds.Min.Y,
+                                    (corner_index & 4) ? bounds.Max.Z : bounds.Min.Z));
+   }
 
-   m_middle_point = FVector::ZeroVector;
+   OUT_samples.Add(bounds.GetCenter());
 
-   // Vertex Buffer
-   if (!IsValidLowLevel()) return;
-   if (!m_portal_mesh) return;
-   if (!m_portal_mesh->GetStaticMesh()) return;
-   if (!m_portal_mesh->GetStaticMesh()->GetRenderData()) return;
+   if (samples_per_side <= 0)
+      return;
 
-   FStaticMeshLODResources& LOD_model = m_portal_mesh->GetStaticMesh()->GetRenderData()->LODResources[0];
-   int32 nb_vertices = LOD_model.VertexBuffers.StaticMeshVertexBuffer.GetNumVertices();
+   // Grid on the face of the portal, which is perpendicular to the thinnest axis of the bounds
+   const FVector extent = bounds.GetExtent();
+   const int32 normal_axis = (extent.X <= extent.Y && extent.X <= extent.Z) ? 0 : (extent.Y <= extent.Z ? 1 : 2);
+   const int32 u_axis = (normal_axis + 1) % 3;
+   const int32 v_axis = (normal_axis + 2) % 3;
 
-   for (int32 vertex_index = 0; vertex_index < nb_vertices; ++vertex_index)
+   for (int32 u = 1; u <= samples_per_side; ++u)
    {
-      const FVector3f& local_position = LOD_model.VertexBuffers.PositionVertexBuffer.VertexPosition(vertex_index);
-      const FVector world_position = m_portal_mesh->GetComponentTransform().TransformPosition(UE::Math::TVector<double>(local_position));
-      m_vertices.Add(world_position);
+      for (int32 v = 1; v <= samples_per_side; ++v)
+      {
+         FVector sample = bounds.GetCenter();
+         sample[u_axis] = FMath::Lerp(bounds.Min[u_axis], bounds.Max[u_axis], float(u) / (samples_per_side + 1));
+         sample[v_axis] = FMath::Lerp(bounds.Min[v_axis], bounds.Max[v_axis], float(v) / (samples_per_side + 1));
 
-      m_middle_point += world_position;
+         OUT_samples.Add(sample);
+      }
    }
-
-   m_middle_point /= nb_vertices;
 }
 
 
 const TArray<FVector>* APortal::GetMeshVertices() const
 {
-   if (m_vertices.Num() == 0)
+   if (m_local_vertices.Num() == 0)
       LoadMeshVertices();
 
+   else if (!m_is_world_space_cache_valid)
+      UpdateWorldSpaceCache();
+
    return &m_vertices;
 }
 
 
-// Recursive function
-void APortal::Render(const FTransform watched_actor_transform, const FMatrix& projection_matrix, unsigned int depth)
+FVector APortal::GetMiddlePoint() const
+{
+   GetMeshVertices();
+
+   return m_middle_point;
+}
+
+
+FPlane APortal::GetPortalPlane() const
+{
+   if (!m_is_world_space_cache_valid)
+      UpdateWorldSpaceCache();
+
+   return m_portal_plane;
+}
+
+
+void APortal::SetSceneCaptureRenderTargets(const TArray<UTextureRenderTarget2D*>& render_targets, const FMatrix& view_projection_matrix)
+{
+   m_texture_view_projection_matrix = view_projection_matrix;
+   m_right_eye_render_targets.Reset();
+
+   // Every SceneCapture is bound, so that none keeps the texture of the previous node or view
+   for (int i = 0; i < m_scene_captures.Num(); i++)
+      m_scene_captures[i]->SetCaptureTarget(render_targets.IsValidIndex(i) ? render_targets[i] : m_scene_captures[i]->GetRenderTarget());
+}
+
+
+void APortal::SetRightEyeRenderTargets(const TArray<UTextureRenderTarget2D*>& render_targets, const FMatrix& view_projection_matrix)
+{
+   m_right_eye_render_targets = render_targets;
+   m_right_eye_view_projection_matrix = view_projection_matrix;
+}
+
+
+void APortal::UpdateCaptureViews(const FTransform& watched_actor_transform, const FMatrix& projection_matrix)
 {
-   // In case we have to make copies to restore them afterwards
-   TMap<APortal*, TArray<UTextureRenderTarget2D*>> portal_to_textures_copies;
+   for (UPortalSceneCapture* scene_capture : m_scene_captures)
+      scene_capture->UpdateView(watched_actor_transform, projection_matrix);
+}
+
 
-   UpdateCaptures(watched_actor_transform, projection_matrix);
+void APortal::CaptureScenes(unsigned int depth, TConstArrayView<bool> skipped_scene_captures)
+{
+   const FPortalCaptureQualityTier& quality_tier = GetDefault<UPortalQualitySettings>()->GetTier(depth);
 
-   // If we reached the max depth, we directly capture the scene
-   if (depth < m_MAX_RENDER_DEPTH)
+   for (int32 i = 0; i < m_scene_captures.Num(); ++i)
    {
-      TMap<APortal*, FTransform> visible_portals_to_watched_actor;
+      if ((skipped_scene_captures.IsValidIndex(i) && skipped_scene_captures[i]) || IsSceneCaptureSkipped(i))
+         continue;
 
-      // For each portal, if it's visible from the current one, store it
-      for (TActorIterator<APortal> portals_it(GetWorld()); portals_it; ++portals_it)
+      m_scene_captures[i]->ApplyQualityTier(quality_tier);
+      m_scene_captures[i]->Capture();
+   }
+}
+
+
+int32 APortal::GetRenderedSceneCaptureCount() const
+{
+   int32 nb_rendered = 0;
+
+   for (int32 i = 0; i < m_scene_captures.Num(); ++i)
+      nb_rendered += IsSceneCaptureSkipped(i) ? 0 : 1;
+
+   return nb_rendered;
+}
+
+
+void APortal::UpdatePortalTexture(int32 view_index)
+{
+   SCOPE_CYCLE_COUNTER(STAT_PortalUpdateTexture);
+   TRACE_CPUPROFILER_EVENT_SCOPE(APortal::UpdatePortalTexture);
+
+   TArray<FPortalCaptureParameters, TInlineAllocator<5>> captures;
+   GatherCaptureParameters(view_index, captures);
+
+   if (view_index != 0 || !m_use_blueprint_textures)
+   {
+      UpdateMaterialParameters(view_index, captures);
+      return;
+   }
+
+   TArray<FTextureToRender> portal_textures;
+   portal_textures.Reserve(captures.Num());
+
+   for (const FPortalCaptureParameters& capture : captures)
+   {
+      FTextureToRender texture_to_render;
+      texture_to_render.is_mirror = capture.is_mirror;
+      texture_to_render.weight = capture.weight;
+      texture_to_render.texture = capture.texture;
+      texture_to_render.view_projection_matrix = m_texture_view_projection_matrix;
+
+      if (m_right_eye_render_targets.Num() > 0)
       {
-         APortal* portal = *portals_it;
-
-         for (auto* scene_capture : m_scene_captures)
-         {
-            // If the portal checked is the one linked to the current SC, we ignore it
-            if (portal != scene_capture->GetLinkedPortal())
-            {
-               // Distance between the camera and the linked portal
-               float near_plane_distance = FMath::Abs(FVector::Dist(scene_capture->GetComponentLocation(), scene_capture->GetLinkedPortal()->GetActorLocation()));
-
-               if (Tools::isPortalVisibleToCamera(portal, scene_capture, near_plane_distance))
-               {
-                  // If the portal is waiting to be captured, we create a temporary copy of its textures
-                  if (portal->IsRendererButNotCaptured())
-                  {
-                     TArray<UTextureRenderTarget2D*> texture_copies;
-                     for (auto* scene_capture_to_copy : portal->m_scene_captures)
-                     {
-                        auto* texture_original = scene_capture_to_copy->GetRenderTarget();
-                        auto* texture_copy = DuplicateObject<UTextureRenderTarget2D>(texture_original, texture_original->GetOuter(), "Texture copy");
-                        scene_capture_to_copy->SetRenderTarget(texture_copy);
-
-                        texture_copies.Add(texture_original);
-                     }
-
-                     portal_to_textures_copies.Add(portal, std::move(texture_copies));
-                  }
-
-                  visible_portals_to_watched_actor.Add(portal, scene_capture->GetComponentTransform());
-               }
-            }
-         }
+         texture_to_render.right_eye_texture = capture.right_eye_texture;
+         texture_to_render.right_eye_view_projection_matrix = m_right_eye_view_projection_matrix;
       }
 
-      // Rendering every visible portal
-      for (auto& visible_portal : visible_portals_to_watched_actor)
+      portal_textures.Add(texture_to_render);
+   }
+
+   SetRTT(portal_textures);
+}
+
+
+void APortal::GatherCaptureParameters(int32 view_index, TArray<FPortalCaptureParameters, TInlineAllocator<5>>& OUT_captures)
+{
+   OUT_captures.Reset();
+
+   for (int32 i = 0; i < m_scene_captures.Num(); ++i)
+   {
+      const UPortalSceneCapture* scene_capture = m_scene_captures[i];
+
+      FPortalCaptureParameters& capture = OUT_captures.AddDefaulted_GetRef();
+      capture.texture = scene_capture->GetCaptureTarget();
+      capture.right_eye_texture = m_right_eye_render_targets.IsValidIndex(i) ? m_right_eye_render_targets[i] : capture.texture;
+      capture.weight = scene_capture->getWeight();
+      capture.is_mirror = scene_capture->getType() == ECameraType::Mirror;
+   }
+
+   if (OUT_captures.Num() < 2 || !ShouldCompositeCaptures())
+      return;
+
+   FPortalCaptureParameters composite;
+   composite.texture = CompositeCaptures(view_index, false, OUT_captures);
+   composite.right_eye_texture = m_right_eye_render_targets.Num() > 0 ? CompositeCaptures(view_index, true, OUT_captures) : composite.texture;
+   composite.weight = 1.f;
+
+   // The other textures the material takes get no weight
+   const int32 nb_material_textures = FMath::Min(OUT_captures.Num(), int32(m_MAX_MATERIAL_TEXTURES));
+
+   OUT_captures.Reset();
+   OUT_captures.Add(composite);
+
+   composite.weight = 0.f;
+   while (OUT_captures.Num() < nb_material_textures)
+      OUT_captures.Add(composite);
+}
+
+
+const UTexture* APortal::CompositeCaptures(int32 view_index, bool is_right_eye, const TArray<FPortalCaptureParameters, TInlineAllocator<5>>& captures)
+{
+   UPortalRenderTargetPool* render_target_pool = GetWorld() ? GetWorld()->GetSubsystem<UPortalRenderTargetPool>() : nullptr;
+   if (!render_target_pool)
+      return captures[0].texture;
+
+   // Weights are relative to each other, as in the material
+   float total_weight = 0.f;
+   for (const FPortalCaptureParameters& capture : captures)
+      total_weight += FMath::Max(capture.weight, 0.f);
+
+   const float min_weight = total_weight * GetMinCompositeWeight();
+   float blended_weight = 0.f;
+   FIntPoint size(1, 1);
+   const UTextureRenderTarget2D* first_render_target = nullptr;
+
+   for (const FPortalCaptureParameters& capture : captures)
+   {
+      const UTexture* texture = is_right_eye ? capture.right_eye_texture : capture.texture;
+
+      if (!texture || capture.weight <= 0.f || capture.weight < min_weight)
+         continue;
+
+      if (!first_render_target)
+         first_render_target = Cast<UTextureRenderTarget2D>(texture);
+
+      blended_weight += capture.weight;
+      size = size.ComponentMax(FIntPoint(FMath::CeilToInt(texture->GetSurfaceWidth()), FMath::CeilToInt(texture->GetSurfaceHeight())));
+   }
+
+   if (blended_weight <= 0.f)
+      return captures[0].texture;
+
+   // Same precision as the captures it blends
+   const EPortalRenderTargetFormat format = first_render_target ? UPortalRenderTargetPool::GetFormat(first_render_target) : UPortalSceneCapture::GetRenderTargetFormat(this, 0);
+
+   const int32 target_index = view_index * 2 + (is_right_eye ? 1 : 0);
+   if (m_composite_render_targets.Num() <= target_index)
+      m_composite_render_targets.SetNumZeroed(target_index + 1);
+
+   // Follows the size of the largest capture
+   UTextureRenderTarget2D*& composite_target = m_composite_render_targets[target_index];
+
+   if (!composite_target || composite_target->SizeX != size.X || composite_target->SizeY != size.Y || UPortalRenderTargetPool::GetFormat(composite_target) != format)
+   {
+      if (composite_target)
+         render_target_pool->ReleaseRenderTarget(composite_target);
+
+      composite_target = render_target_pool->LeaseRenderTarget(size.X, size.Y, format);
+   }
+
+   if (m_composite_states.Num() <= target_index)
+      m_composite_states.SetNum(target_index + 1);
+
+   FPortalCompositeState& state = m_composite_states[target_index];
+
+   // Captures are in the order of the SceneCaptures
+   TArray<uint32, TInlineAllocator<5>> capture_counts;
+   for (const UPortalSceneCapture* scene_capture : m_scene_captures)
+      capture_counts.Add(scene_capture->GetCaptureCount());
+
+   // Nothing was captured since the last blend, the texture is up to date
+   if (state.target == composite_target && state.min_weight == min_weight && state.captures == captures && state.capture_counts == capture_counts)
+      return composite_target;
+
+   state.target = composite_target;
+   state.captures = captures;
+   state.capture_counts = capture_counts;
+   state.min_weight = min_weight;
+
+   UKismetRenderingLibrary::ClearRenderTarget2D(this, composite_target, FLinearColor::Black);
+
+   UCanvas* canvas = nullptr;
+   FVector2D canvas_size;
+   FDrawToRenderTargetContext context;
+   UKismetRenderingLibrary::BeginDrawCanvasToRenderTarget(this, composite_target, canvas, canvas_size, context);
+
+   if (canvas)
+   {
+      for (const FPortalCaptureParameters& capture : captures)
       {
-         APortal* portal = visible_portal.Key;
-         FTransform wa_transform = visible_portal.Value;
+         const UTexture* texture = is_right_eye ? capture.right_eye_texture : capture.texture;
+
+         if (!texture || capture.weight <= 0.f || capture.weight < min_weight)
+            continue;
+
+         const float weight = capture.weight / blended_weight;
 
-         portal->Render(wa_transform, projection_matrix, depth + 1);
+         // Mirrored horizontally, as the material does for the mirror textures
+         const FVector2D coordinate_position = capture.is_mirror ? FVector2D(1.f, 0.f) : FVector2D::ZeroVector;
+         const FVector2D coordinate_size = capture.is_mirror ? FVector2D(-1.f, 1.f) : FVector2D::UnitVector;
+
+         canvas->K2_DrawTexture(const_cast<UTexture*>(texture), FVector2D::ZeroVector, canvas_size, coordinate_position, coordinate_size, FLinearColor(weight, weight, weight, 1.f), BLEND_Additive);
       }
+   }
+
+   UKismetRenderingLibrary::EndDrawCanvasToRenderTarget(this, context);
+
+   return composite_target;
+}
+
+
+int APortal::GetActivePortalDistance()
+{
+   const int32 active_distance = CVarPortalActiveDistance.GetValueOnGameThread();
 
-      for (auto& visible_portal : visible_portals_to_watched_actor)
-         visible_portal.Key->SetIsRendererButNotCaptured(false);
+   return FMath::Max(active_distance >= 0 ? active_distance : GetDefault<UPortalQualitySettings>()->GetActivePortalDistance(), 1);
+}
+
+
+unsigned int APortal::GetMaxRenderDepth()
+{
+   const int32 max_render_depth = CVarPortalMaxRenderDepth.GetValueOnGameThread();
+
+   return static_cast<unsigned int>(FMath::Max(max_render_depth >= 0 ? max_render_depth : GetDefault<UPortalQualitySettings>()->GetMaxRenderDepth(), 0));
+}
+
+
+float APortal::GetMinCompositeWeight()
+{
+   return FMath::Clamp(CVarPortalCompositeMinWeight.GetValueOnGameThread(), 0.f, 1.f);
+}
+
+
+void APortal::SetViews(const TArray<APlayerController*>& view_controllers)
+{
+   if (!m_portal_mesh)
+      return;
+
+   const int32 nb_view_meshes = FMath::Max(view_controllers.Num() - 1, 0);
+
+   while (m_view_meshes.Num() > nb_view_meshes)
+   {
+      m_view_meshes.Pop()->DestroyComponent();
+      m_view_materials.Pop();
    }
 
-   UpdateCaptures(watched_actor_transform, projection_matrix);
-   UpdatePortalTexture();
+   // A new material could be allocated where a removed one was, its state must not be kept
+   if (m_material_states.Num() > nb_view_meshes + 1)
+      m_material_states.SetNum(nb_view_meshes + 1);
+
+   while (m_view_meshes.Num() < nb_view_meshes)
+   {
+      UStaticMeshComponent* view_mesh = CreateViewMesh();
+
+      m_view_meshes.Add(view_mesh);
+      m_view_materials.Add(view_mesh->CreateDynamicMaterialInstance(0));
+   }
 
-   // We restore all texture copies
-   for (auto& copied_portal : portal_to_textures_copies)
+   // Every player only sees the mesh of its view
+   for (int32 view_index = 0; view_index < view_controllers.Num(); ++view_index)
    {
-      APortal* portal = copied_portal.Key;
-      for (int i = 0; i < portal->m_scene_captures.Num(); i++)
-         portal->m_scene_captures[i]->SetRenderTarget(copied_portal.Value[i]);
+      APlayerController* controller = view_controllers[view_index];
+
+      if (!controller)
+         continue;
 
-      portal->UpdatePortalTexture();
+      if (view_index == 0)
+         controller->HiddenPrimitiveComponents.Remove(m_portal_mesh);
+      else
+         controller->HiddenPrimitiveComponents.AddUnique(m_portal_mesh);
+
+      for (int32 mesh_index = 0; mesh_index < m_view_meshes.Num(); ++mesh_index)
+      {
+         if (mesh_index == view_index - 1)
+            controller->HiddenPrimitiveComponents.Remove(m_view_meshes[mesh_index]);
+         else
+            controller->HiddenPrimitiveComponents.AddUnique(m_view_meshes[mesh_index]);
+      }
    }
+}
+
+
+UStaticMeshComponent* APortal::CreateViewMesh()
+{
+   UStaticMeshComponent* view_mesh = NewObject<UStaticMeshComponent>(this);
+
+   view_mesh->SetStaticMesh(m_portal_mesh->GetStaticMesh());
+   view_mesh->SetMaterial(0, GetBaseMaterial());
+   view_mesh->SetMobility(m_portal_mesh->Mobility);
+   view_mesh->SetCollisionEnabled(ECollisionEnabled::NoCollision);
+   view_mesh->SetCastShadow(false);
 
-   // Prevent to override the texture rendered in the next iterations
-   SetIsRendererButNotCaptured(true);
+   // The captures render the portal mesh, whose material is the one updated for them
+   view_mesh->bHiddenInSceneCapture = true;
 
-   SetActive(true);
+   view_mesh->AttachToComponent(m_portal_mesh, FAttachmentTransformRules::SnapToTargetIncludingScale);
+   view_mesh->RegisterComponent();
+
+   return view_mesh;
 }
 
 
-void APortal::UpdateCaptures(const FTransform& watched_actor_transform, const FMatrix& projection_matrix)
+UMaterialInterface* APortal::GetBaseMaterial() const
 {
-   for (UPortalSceneCapture* scene_capture : m_scene_captures)
-      scene_capture->Update(watched_actor_transform, projection_matrix);
+   UMaterialInterface* material = m_portal_mesh ? m_portal_mesh->GetMaterial(0) : nullptr;
+
+   if (const UMaterialInstanceDynamic* dynamic_material = Cast<UMaterialInstanceDynamic>(material))
+      return dynamic_material->Parent;
+
+   return material;
 }
 
 
-void APortal::UpdatePortalTexture()
+UMaterialInstanceDynamic* APortal::GetViewMaterial(int32 view_index)
 {
-   TArray<FTextureToRender> portal_textures;
+   if (view_index > 0)
+      return m_view_materials.IsValidIndex(view_index - 1) ? m_view_materials[view_index - 1] : nullptr;
 
-   for (UPortalSceneCapture* scene_capture : m_scene_captures)
+   if (!m_material && m_portal_mesh)
+      m_material = m_portal_mesh->CreateDynamicMaterialInstance(0, GetBaseMaterial());
+
+   return m_material;
+}
+
+
+void APortal::UpdateMaterialParameters(int32 view_index, const TArray<FPortalCaptureParameters, TInlineAllocator<5>>& captures)
+{
+   UMaterialInstanceDynamic* material = GetViewMaterial(view_index);
+   if (!material)
+      return;
+
+   if (m_material_states.Num() <= view_index)
+      m_material_states.SetNum(view_index + 1);
+
+   FPortalMaterialState& state = m_material_states[view_index];
+
+   if (state.material != material)
    {
-      FTextureToRender texture_to_render;
-      texture_to_render.is_mirror = scene_capture->getType() == ECameraType::Mirror;
-      texture_to_render.weight = scene_capture->getWeight();
-      texture_to_render.texture = scene_capture->GetRenderTarget();
+      state = FPortalMaterialState();
+      state.material = material;
+   }
+
+   UpdateParameterNames();
+
+   // The parameters of the SceneCaptures added since the last call were never set
+   const int32 nb_captures = FMath::Min(captures.Num(), int32(m_MAX_MATERIAL_TEXTURES));
+   const int32 nb_known_captures = FMath::Min(state.captures.Num(), nb_captures);
+   state.captures.SetNum(nb_captures);
+
+   for (int32 i = 0; i < nb_captures; ++i)
+   {
+      FPortalCaptureParameters& parameters = state.captures[i];
+      const bool is_known = i < nb_known_captures;
+
+      const UTexture* texture = captures[i].texture;
+      const UTexture* right_eye_texture = captures[i].right_eye_texture;
+      const float weight = captures[i].weight;
+      const bool is_mirror = captures[i].is_mirror;
+
+      if ((!is_known || parameters.texture != texture) && !m_parameter_names.textures[i].IsNone())
+         material->SetTextureParameterValue(m_parameter_names.textures[i], const_cast<UTexture*>(texture));
 
-      portal_textures.Add(std::move(texture_to_render));
+      if ((!is_known || parameters.right_eye_texture != right_eye_texture) && !m_parameter_names.right_eye_textures[i].IsNone())
+         material->SetTextureParameterValue(m_parameter_names.right_eye_textures[i], const_cast<UTexture*>(right_eye_texture));
+
+      if ((!is_known || parameters.weight != weight) && !m_parameter_names.weights[i].IsNone())
+         material->SetScalarParameterValue(m_parameter_names.weights[i], weight);
+
+      if ((!is_known || parameters.is_mirror != is_mirror) && i == 0 && !m_parameter_names.mirror.IsNone())
+         material->SetScalarParameterValue(m_parameter_names.mirror, is_mirror ? 1.f : 0.f);
+
+      parameters.texture = texture;
+      parameters.right_eye_texture = right_eye_texture;
+      parameters.weight = weight;
+      parameters.is_mirror = is_mirror;
    }
 
-   SetRTT(portal_textures);
+   if (nb_captures == 0)
+      return;
+
+   // Same for every texture, they are captured from the same view
+   const FMatrix& right_eye_view_projection_matrix = m_right_eye_render_targets.Num() > 0 ? m_right_eye_view_projection_matrix : m_texture_view_projection_matrix;
+
+   if (!state.are_matrices_set || state.view_projection_matrix != m_texture_view_projection_matrix)
+      SetMatrixParameter(material, m_parameter_names.view_projection_rows, m_texture_view_projection_matrix);
+
+   if (!state.are_matrices_set || state.right_eye_view_projection_matrix != right_eye_view_projection_matrix)
+      SetMatrixParameter(material, m_parameter_names.right_eye_view_projection_rows, right_eye_view_projection_matrix);
+
+   state.view_projection_matrix = m_texture_view_projection_matrix;
+   state.right_eye_view_projection_matrix = right_eye_view_projection_matrix;
+   state.are_matrices_set = true;
+}
+
+
+void APortal::UpdateParameterNames()
+{
+   FPortalMaterialParameterNames& names = m_parameter_names;
+
+   // Past those, the captures are composited into the first texture
+   const int32 nb_material_textures = FMath::Min(m_scene_captures.Num(), int32(m_MAX_MATERIAL_TEXTURES));
+
+   if (names.textures.Num() >= nb_material_textures)
+      return;
+
+   if (names.textures.Num() == 0)
+   {
+      names.mirror = m_mirror_parameter_name;
+
+      for (int32 row = 0; row < 4; ++row)
+      {
+         names.view_projection_rows[row] = FName(*FString::Printf(TEXT("%sRow%d"), *m_view_projection_parameter_name.ToString(), row));
+         names.right_eye_view_projection_rows[row] = FName(*FString::Printf(TEXT("%sRightRow%d"), *m_view_projection_parameter_name.ToString(), row));
+      }
+   }
+
+   for (int32 i = names.textures.Num(); i < nb_material_textures; ++i)
+   {
+      const FName texture_name = m_texture_parameter_names.IsValidIndex(i) ? m_texture_parameter_names[i] : NAME_None;
+
+      names.textures.Add(texture_name);
+      names.right_eye_textures.Add(texture_name.IsNone() ? NAME_None : FName(*FString::Printf(TEXT("%s right"), *texture_name.ToString())));
+      names.weights.Add(m_weight_parameter_names.IsValidIndex(i) ? m_weight_parameter_names[i] : NAME_None);
+   }
+}
+
+
+void APortal::SetMatrixParameter(UMaterialInstanceDynamic* material, const FName (&row_names)[4], const FMatrix& matrix)
+{
+   for (int32 row = 0; row < 4; ++row)
+   {
+      const FLinearColor row_value(matrix.M[row][0], matrix.M[row][1], matrix.M[row][2], matrix.M[row][3]);
+      material->SetVectorParameterValue(row_names[row], row_value);
+   }
 }
 
 
@@ -249,7 +707,6 @@ void APortal::SetDefaultSceneCaptureParameters(UPortalSceneCapture* inout_scene_
 {   
    inout_scene_capture->bCaptureEveryFrame = false;
    inout_scene_capture->bCaptureOnMovement = false;
-   inout_scene_capture->LODDistanceFactor = 3;          //Force bigger LODs for faster computations
    inout_scene_capture->TextureTarget = nullptr;
    inout_scene_capture->bEnableClipPlane = true;
    inout_scene_capture->bUseCustomProjectionMatrix = true;
@@ -266,13 +723,11 @@ void APortal::SetDefaultSceneCaptureParameters(UPortalSceneCapture* inout_scene_
    capture_settings.bOverride_FilmGrainIntensity = true;
    capture_settings.bOverride_ScreenSpaceReflectionQuality = true;
    
-
-   capture_settings.AmbientOcclusionQuality = 100.0f; // 100 = maximum quality
+   // AO, SSR, shadows, LODs... depend on the depth of the capture, see UPortalQualitySettings
    capture_settings.MotionBlurAmount = 0.0f;   // 0 = disabled
    capture_settings.MotionBlurMax = 0.0f;   // 0 = disabled
    capture_settings.SceneFringeIntensity = 0.0f;   // 0 = disabled
    capture_settings.FilmGrainIntensity = 0.0f;   // 0 = disabled
-   capture_settings.ScreenSpaceReflectionQuality = 50.0f;  // 50 = default
 }
 
 bool APortal::IsPointInsideBox(FVector point, UBoxComponent* box)
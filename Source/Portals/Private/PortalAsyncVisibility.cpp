@@ -0,0 +1,101 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#include "PortalAsyncVisibility.h"
+
+#include <Camera/CameraComponent.h>
+#include <Engine/World.h>
+
+#include "Portal.h"
+#include "PortalSceneCapture.h"
+#include "PortalStats.h"
+#include "PortalTools.h"
+
+
+bool FPortalAsyncVisibility::IsPortalVisible(APortal* portal, USceneComponent* camera, uint32 path_hash)
+{
+   UWorld* world = camera->GetWorld();
+   FEntry& entry = m_entries.FindOrAdd(FKey(portal, camera, path_hash));
+
+   // Already tested during this frame
+   if (entry.submit_frame == GFrameCounter)
+      return entry.is_visible;
+
+   // The async traces are only available during the frame following their submission
+   // Otherwise we keep the last known result
+   bool is_visible;
+   if (entry.submit_frame + 1 == GFrameCounter && ReadTraces(world, entry, is_visible))
+      entry.is_visible = is_visible;
+
+   SubmitTraces(world, portal, camera, entry);
+
+   return entry.is_visible;
+}
+
+
+void FPortalAsyncVisibility::RemoveStaleEntries()
+{
+   for (auto entry_it = m_entries.CreateIterator(); entry_it; ++entry_it)
+   {
+      if (entry_it.Value().submit_frame + 2 < GFrameCounter)
+         entry_it.RemoveCurrent();
+   }
+}
+
+
+bool FPortalAsyncVisibility::ReadTraces(UWorld* world, const FEntry& entry, bool& OUT_is_visible)
+{
+   OUT_is_visible = false;
+
+   for (int i = 0; i < entry.trace_handles.Num(); i++)
+   {
+      // The vertex could not be seen through the linked portal
+      if (!entry.trace_handles[i].IsValid())
+         continue;
+
+      FTraceDatum trace_datum;
+      if (!world->QueryTraceData(entry.trace_handles[i], trace_datum))
+         return false;
+
+      const FHitResult* hit_result = trace_datum.OutHits.FindByPredicate([](const FHitResult& hit) { return hit.bBlockingHit; });
+
+      // If one vertex of the portal is directly visible (not hidden) to the camera, we render it
+      // Same if the impact is near the portal, it may be because the portal is integrated in a wall
+      if (!hit_result || FVector::Distance(hit_result->Location, entry.vertices[i]) < Tools::GetEmbeddedPortalDistance())
+      {
+         OUT_is_visible = true;
+         return true;
+      }
+   }
+
+   return true;
+}
+
+
+void FPortalAsyncVisibility::SubmitTraces(UWorld* world, APortal* portal, USceneComponent* camera, FEntry& OUT_entry)
+{
+   const ECollisionChannel collision_channel = ECollisionChannel::ECC_Camera;
+   const FCollisionQueryParams params = Tools::GetVertexTraceParams(portal, camera);
+
+   UPortalSceneCapture* scene_capture = Cast<UPortalSceneCapture>(camera);
+
+   OUT_entry.trace_handles.Reset();
+   OUT_entry.vertices = *(portal->GetMeshVertices());
+   OUT_entry.submit_frame = GFrameCounter;
+
+   for (const FVector& vertex : OUT_entry.vertices)
+   {
+      FVector start = camera->GetComponentLocation();
+
+      // The trace through the linked portal only tests one actor, it is cheap enough to stay synchronous
+      if (scene_capture && !Tools::TraceThroughLinkedPortal(start, scene_capture, vertex, params))
+      {
+         OUT_entry.trace_handles.Add(FTraceHandle());
+         continue;
+      }
+
+      INC_DWORD_STAT(STAT_PortalLineTraces);
+
+      // All these traces are run together by the world at the end of the frame
+      OUT_entry.trace_handles.Add(world->AsyncLineTraceByChannel(EAsyncTraceType::Single, start, vertex, collision_channel, params));
+   }
+}
@@ -0,0 +1,443 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#include "PortalBenchmark.h"
+
+#include <Runtime/Engine/Public/EngineUtils.h>
+#include <Engine/World.h>
+#include <GameFramework/CharacterMovementComponent.h>
+#include <HAL/IConsoleManager.h>
+#include <HAL/PlatformMemory.h>
+#include <Kismet/GameplayStatics.h>
+#include <Misc/FileHelper.h>
+#include <Misc/Paths.h>
+#include <RenderCore.h>
+#include <RHI.h>
+
+#include "PortalCharacter.h"
+#include "PortalGameModeBase.h"
+#include "PortalManager.h"
+#include "PortalRenderTargetPool.h"
+#include "PortalSceneCapture.h"
+#include "SimplePortal.h"
+#include "TeleporterPortal.h"
+
+
+// Portals.Benchmark <Scenario> [NbPortals] [QuitWhenDone], e.g. -ExecCmds="Portals.Benchmark ManyPortals 100 1" for automated runs
+static FAutoConsoleCommandWithWorldAndArgs PortalBenchmarkCommand(
+   TEXT("Portals.Benchmark"),
+   TEXT("Run a portal benchmark: Portals.Benchmark <FacingMirrors|PortalChain|ManyPortals|RapidTeleports> [NbPortals] [QuitWhenDone]. Results are written as CSV in Saved/Profiling/Portals."),
+   FConsoleCommandWithWorldAndArgsDelegate::CreateLambda([](const TArray<FString>& args, UWorld* world)
+   {
+      if (!world || args.Num() == 0)
+         return;
+
+      const int64 scenario = StaticEnum<EPortalBenchmarkScenario>()->GetValueByNameString(args[0]);
+
+      if (scenario == INDEX_NONE)
+      {
+         UE_LOG(LogTemp, Warning, TEXT("Portals.Benchmark: unknown scenario %s"), *args[0]);
+         return;
+      }
+
+      APortalBenchmark* benchmark = world->SpawnActorDeferred<APortalBenchmark>(APortalBenchmark::StaticClass(), FTransform::Identity);
+
+      benchmark->SetScenario(EPortalBenchmarkScenario(scenario), args.Num() > 1 ? FCString::Atoi(*args[1]) : 0);
+
+      if (args.Num() > 2 && FCString::Atoi(*args[2]) != 0)
+         benchmark->SetQuitWhenDone(true);
+
+      benchmark->FinishSpawning(FTransform::Identity);
+   }));
+
+
+APortalBenchmark::APortalBenchmark(const FObjectInitializer& ObjectInitializer) :
+   Super(ObjectInitializer)
+{
+   PrimaryActorTick.bCanEverTick = true;
+}
+
+
+void APortalBenchmark::SetScenario(EPortalBenchmarkScenario scenario, int32 nb_portals)
+{
+   m_scenario = scenario;
+
+   if (nb_portals > 0)
+      m_nb_portals = nb_portals;
+}
+
+
+FString APortalBenchmark::GetResultPath() const
+{
+   const FString scenario_name = StaticEnum<EPortalBenchmarkScenario>()->GetNameStringByValue(int64(m_scenario));
+   const FString file_name = FString::Printf(TEXT("%s_%d_%s.csv"), *scenario_name, m_nb_portals, *m_start_time.ToString());
+
+   return FPaths::Combine(FPaths::ProfilingDir(), TEXT("Portals"), file_name);
+}
+
+
+void APortalBenchmark::BeginPlay()
+{
+   Super::BeginPlay();
+
+   m_start_time = FDateTime::Now();
+   m_frame = 0;
+   m_is_done = false;
+   m_samples.Reset();
+   m_samples.Reserve(m_nb_frames);
+}
+
+
+void APortalBenchmark::EndPlay(const EEndPlayReason::Type EndPlayReason)
+{
+   // Keep what has been measured if the run is interrupted
+   if (!m_is_done && m_samples.Num() > 0)
+      WriteResults();
+
+   RestoreLevel();
+
+   Super::EndPlay(EndPlayReason);
+}
+
+
+void APortalBenchmark::Tick(float DeltaSeconds)
+{
+   Super::Tick(DeltaSeconds);
+
+   if (m_is_done)
+      return;
+
+   APlayerController* controller = UGameplayStatics::GetPlayerController(GetWorld(), 0);
+   APortalCharacter* character = controller ? Cast<APortalCharacter>(controller->GetCharacter()) : nullptr;
+
+   if (!character)
+      return;
+
+   // Spawned on the first tick, once the game mode created the portal manager the portals register to
+   if (m_frame == 0)
+   {
+      SpawnScenario();
+
+      if (m_camera_path.Num() == 0)
+         ComputeDefaultCameraPath();
+
+      m_character = character;
+      m_character_transform = character->GetActorTransform();
+      m_control_rotation = controller->GetControlRotation();
+      m_movement_mode = character->GetCharacterMovement()->MovementMode;
+
+      // The path places the player, it shouldn't fall or be pushed around
+      character->GetCharacterMovement()->DisableMovement();
+   }
+
+   const int32 nb_total_frames = m_nb_warmup_frames + m_nb_frames;
+
+   if (m_scenario == EPortalBenchmarkScenario::RapidTeleports && m_frame > 0)
+   {
+      APortalGameModeBase* game_mode = GetWorld()->GetAuthGameMode<APortalGameModeBase>();
+      APortalManager* portal_manager = game_mode ? game_mode->GetPortalManager() : nullptr;
+
+      // Go back and forth between the two teleporters
+      if (portal_manager && m_spawned_portals.Num() == 2 && m_frame % m_teleport_interval == 0)
+      {
+         ATeleporterPortal* teleporter = Cast<ATeleporterPortal>(m_spawned_portals[(m_frame / m_teleport_interval) % 2]);
+         portal_manager->RequestTeleportByPortal(teleporter, character);
+      }
+   }
+   else
+   {
+      const FTransform camera_transform = GetCameraPathTransform(m_frame / float(FMath::Max(nb_total_frames - 1, 1)));
+
+      character->SetActorLocation(camera_transform.GetLocation());
+      controller->SetControlRotation(camera_transform.Rotator());
+   }
+
+   // The timings read this frame are the ones of the previous frame
+   if (m_frame > m_nb_warmup_frames)
+      RecordSample();
+
+   if (++m_frame > nb_total_frames)
+   {
+      m_is_done = true;
+      WriteResults();
+      RestoreLevel();
+
+      if (m_quit_when_done)
+         FPlatformMisc::RequestExit(false);
+   }
+}
+
+
+void APortalBenchmark::RestoreLevel()
+{
+   for (APortal* portal : m_spawned_portals)
+   {
+      if (IsValid(portal))
+         portal->Destroy();
+   }
+
+   m_spawned_portals.Reset();
+
+   APortalCharacter* character = m_character.Get();
+   m_character.Reset();
+
+   if (!character)
+      return;
+
+   character->SetActorTransform(m_character_transform, false, nullptr, ETeleportType::ResetPhysics);
+   character->GetCharacterMovement()->SetMovementMode(m_movement_mode);
+
+   if (AController* controller = character->GetController())
+      controller->SetControlRotation(m_control_rotation);
+}
+
+
+void APortalBenchmark::SpawnScenario()
+{
+   m_simple_portal_class = FindPortalClass(m_simple_portal_class);
+   m_teleporter_portal_class = FindPortalClass(m_teleporter_portal_class);
+
+   switch (m_scenario)
+   {
+   case EPortalBenchmarkScenario::FacingMirrors:
+      SpawnFacingMirrors();
+      break;
+
+   case EPortalBenchmarkScenario::PortalChain:
+      SpawnPortalChain();
+      break;
+
+   case EPortalBenchmarkScenario::ManyPortals:
+      SpawnManyPortals();
+      break;
+
+   case EPortalBenchmarkScenario::RapidTeleports:
+      SpawnRapidTeleports();
+      break;
+   }
+}
+
+
+void APortalBenchmark::SpawnFacingMirrors()
+{
+   const int32 nb_mirrors = FMath::Max(m_nb_portals, 2);
+   const float radius = m_portal_spacing * 0.5f;
+
+   for (int32 i = 0; i < nb_mirrors; ++i)
+   {
+      const float angle = 2.f * PI * i / nb_mirrors;
+      const FVector location(radius * FMath::Cos(angle), radius * FMath::Sin(angle), 0.f);
+
+      if (ASimplePortal* mirror = BeginSpawnPortal(m_simple_portal_class, location, (-location).Rotation()))
+      {
+         mirror->SetLink(ECameraType::Mirror, mirror);
+         mirror->FinishSpawning(FTransform::Identity, true);
+      }
+   }
+}
+
+
+void APortalBenchmark::SpawnPortalChain()
+{
+   // Looking through the first portal shows the second one, and so on until the depth is reached
+   const int32 depth = m_nb_portals;
+   TArray<ASimplePortal*> chain;
+
+   for (int32 i = 0; i <= depth; ++i)
+   {
+      if (ASimplePortal* portal = BeginSpawnPortal(m_simple_portal_class, FVector(i * m_portal_spacing, 0.f, 0.f), FRotator(0.f, 180.f, 0.f)))
+         chain.Add(portal);
+   }
+
+   for (int32 i = 0; i < chain.Num(); ++i)
+   {
+      // The last one is a mirror, so that the chain ends on something to render
+      if (i + 1 < chain.Num())
+         chain[i]->SetLink(ECameraType::Portal, chain[i + 1], true);
+      else
+         chain[i]->SetLink(ECameraType::Mirror, chain[i]);
+
+      chain[i]->FinishSpawning(FTransform::Identity, true);
+   }
+}
+
+
+void APortalBenchmark::SpawnManyPortals()
+{
+   const int32 nb_columns = FMath::CeilToInt(FMath::Sqrt(float(m_nb_portals)));
+
+   // Linked two by two, every portal shows another part of the grid
+   for (int32 i = 0; i < m_nb_portals; i += 2)
+   {
+      const FVector first_location((i / nb_columns) * m_portal_spacing, (i % nb_columns - nb_columns * 0.5f) * m_portal_spacing, 0.f);
+      const FVector second_location(((i + 1) / nb_columns) * m_portal_spacing, ((i + 1) % nb_columns - nb_columns * 0.5f) * m_portal_spacing, 0.f);
+
+      ASimplePortal* first = BeginSpawnPortal(m_simple_portal_class, first_location, FRotator(0.f, 180.f, 0.f));
+      ASimplePortal* second = i + 1 < m_nb_portals ? BeginSpawnPortal(m_simple_portal_class, second_location, FRotator(0.f, 180.f, 0.f)) : nullptr;
+
+      if (first)
+      {
+         first->SetLink(second ? ECameraType::Portal : ECameraType::Mirror, second ? second : first);
+         first->FinishSpawning(FTransform::Identity, true);
+      }
+
+      if (second)
+      {
+         second->SetLink(first ? ECameraType::Portal : ECameraType::Mirror, first ? first : second);
+         second->FinishSpawning(FTransform::Identity, true);
+      }
+   }
+}
+
+
+void APortalBenchmark::SpawnRapidTeleports()
+{
+   ATeleporterPortal* entry = BeginSpawnPortal(m_teleporter_portal_class, FVector::ZeroVector, FRotator(0.f, 180.f, 0.f));
+   ATeleporterPortal* exit_portal = BeginSpawnPortal(m_teleporter_portal_class, FVector(0.f, m_portal_spacing, 0.f), FRotator(0.f, 180.f, 0.f));
+
+   if (!entry || !exit_portal)
+      return;
+
+   entry->SetLinkedPortal(exit_portal);
+   exit_portal->SetLinkedPortal(entry);
+
+   entry->FinishSpawning(FTransform::Identity, true);
+   exit_portal->FinishSpawning(FTransform::Identity, true);
+}
+
+
+template<class T>
+T* APortalBenchmark::BeginSpawnPortal(TSubclassOf<T> portal_class, const FVector& location, const FRotator& rotation)
+{
+   if (!portal_class)
+      return nullptr;
+
+   const FTransform portal_transform = FTransform(rotation, location) * GetActorTransform();
+
+   T* portal = GetWorld()->SpawnActorDeferred<T>(portal_class, portal_transform, this, nullptr, ESpawnActorCollisionHandlingMethod::AlwaysSpawn);
+
+   if (portal)
+      m_spawned_portals.Add(portal);
+
+   return portal;
+}
+
+
+template<class T>
+TSubclassOf<T> APortalBenchmark::FindPortalClass(TSubclassOf<T> portal_class) const
+{
+   if (portal_class)
+      return portal_class;
+
+   for (TActorIterator<T> portals_it(GetWorld()); portals_it; ++portals_it)
+      return portals_it->GetClass();
+
+   UE_LOG(LogTemp, Warning, TEXT("PortalBenchmark: no %s class set nor found in the level"), *T::StaticClass()->GetName());
+
+   return nullptr;
+}
+
+
+void APortalBenchmark::ComputeDefaultCameraPath()
+{
+   switch (m_scenario)
+   {
+   case EPortalBenchmarkScenario::FacingMirrors:
+      // Turn around at the center of the mirrors
+      for (float yaw : { 0.f, 90.f, 180.f, 270.f, 0.f })
+         m_camera_path.Add(FTransform(FRotator(0.f, yaw, 0.f), FVector::ZeroVector));
+      break;
+
+   case EPortalBenchmarkScenario::PortalChain:
+      // Walk toward the first portal of the chain
+      m_camera_path.Add(FTransform(FRotator::ZeroRotator, FVector(-2.f * m_portal_spacing, 0.f, 0.f)));
+      m_camera_path.Add(FTransform(FRotator::ZeroRotator, FVector(-0.25f * m_portal_spacing, 0.f, 0.f)));
+      break;
+
+   case EPortalBenchmarkScenario::ManyPortals:
+   {
+      // Strafe along the grid, then go into it
+      const float half_width = FMath::CeilToInt(FMath::Sqrt(float(m_nb_portals))) * 0.5f * m_portal_spacing;
+
+      m_camera_path.Add(FTransform(FRotator::ZeroRotator, FVector(-m_portal_spacing, -half_width, 0.f)));
+      m_camera_path.Add(FTransform(FRotator::ZeroRotator, FVector(-m_portal_spacing, half_width, 0.f)));
+      m_camera_path.Add(FTransform(FRotator(0.f, -30.f, 0.f), FVector(-m_portal_spacing, 0.f, 0.f)));
+      m_camera_path.Add(FTransform(FRotator(0.f, 30.f, 0.f), FVector(half_width, 0.f, 0.f)));
+      break;
+   }
+
+   case EPortalBenchmarkScenario::RapidTeleports:
+      // Only the start point, the teleports move the player afterward
+      m_camera_path.Add(FTransform(FRotator::ZeroRotator, FVector(-100.f, 0.f, 0.f)));
+      break;
+   }
+}
+
+
+FTransform APortalBenchmark::GetCameraPathTransform(float alpha) const
+{
+   if (m_camera_path.Num() == 0)
+      return GetActorTransform();
+
+   const float path_position = FMath::Clamp(alpha, 0.f, 1.f) * (m_camera_path.Num() - 1);
+   const int32 key = FMath::Min(FMath::FloorToInt(path_position), m_camera_path.Num() - 1);
+   const int32 next_key = FMath::Min(key + 1, m_camera_path.Num() - 1);
+   const float key_alpha = path_position - key;
+
+   const FTransform& from = m_camera_path[key];
+   const FTransform& to = m_camera_path[next_key];
+
+   const FTransform local_transform(FQuat::Slerp(from.GetRotation(), to.GetRotation(), key_alpha), FMath::Lerp(from.GetLocation(), to.GetLocation(), key_alpha));
+
+   return local_transform * GetActorTransform();
+}
+
+
+void APortalBenchmark::RecordSample()
+{
+   FPortalBenchmarkSample& sample = m_samples.AddDefaulted_GetRef();
+
+   sample.frame = GFrameCounter;
+   sample.game_thread_ms = FPlatformTime::ToMilliseconds(GGameThreadTime);
+   sample.gpu_ms = FPlatformTime::ToMilliseconds(RHIGetGPUFrameCycles());
+   sample.used_physical_memory = FPlatformMemory::GetStats().UsedPhysical;
+
+   APortalGameModeBase* game_mode = GetWorld()->GetAuthGameMode<APortalGameModeBase>();
+
+   if (APortalManager* portal_manager = game_mode ? game_mode->GetPortalManager() : nullptr)
+      sample.nb_captures = portal_manager->GetCaptureCount();
+
+   if (const UPortalRenderTargetPool* render_target_pool = GetWorld()->GetSubsystem<UPortalRenderTargetPool>())
+      sample.render_target_memory = render_target_pool->GetRenderTargetMemory();
+}
+
+
+void APortalBenchmark::WriteResults() const
+{
+   FString csv = TEXT("frame,game_thread_ms,gpu_ms,captures,render_target_memory_mb,used_physical_memory_mb\n");
+
+   float total_game_thread_ms = 0.f;
+   float total_gpu_ms = 0.f;
+
+   for (const FPortalBenchmarkSample& sample : m_samples)
+   {
+      csv += FString::Printf(TEXT("%llu,%.3f,%.3f,%d,%.2f,%.2f\n"),
+                             sample.frame, sample.game_thread_ms, sample.gpu_ms, sample.nb_captures,
+                             sample.render_target_memory / (1024.f * 1024.f), sample.used_physical_memory / (1024.f * 1024.f));
+
+      total_game_thread_ms += sample.game_thread_ms;
+      total_gpu_ms += sample.gpu_ms;
+   }
+
+   const FString result_path = GetResultPath();
+
+   if (!FFileHelper::SaveStringToFile(csv, *result_path))
+   {
+      UE_LOG(LogTemp, Error, TEXT("PortalBenchmark: could not write %s"), *result_path);
+      return;
+   }
+
+   const float nb_samples = FMath::Max(m_samples.Num(), 1);
+
+   UE_LOG(LogTemp, Log, TEXT("PortalBenchmark: %d frames, game thread %.3f ms, GPU %.3f ms on average, written to %s"),
+          m_samples.Num(), total_game_thread_ms / nb_samples, total_gpu_ms / nb_samples, *result_path);
+}
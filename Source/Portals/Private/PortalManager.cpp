@@ -1,21 +1,177 @@
 #include "PortalManager.h"
 
 #include <Runtime/Engine/Public/EngineUtils.h>
+#include <Algo/Sort.h>
+#include <Async/ParallelFor.h>
 #include <Camera/CameraComponent.h>
+#include <ContentStreaming.h>
+#include <ConvexVolume.h>
+#include <Engine/Engine.h>
+#include <Engine/GameViewportClient.h>
+#include <Engine/LocalPlayer.h>
+#include <Engine/TextureRenderTarget2D.h>
 #include <Engine/World.h>
+#include <GameFramework/PlayerController.h>
+#include <HAL/IConsoleManager.h>
 #include <Kismet/GameplayStatics.h>
+#include <RHI.h>
+#include <StereoRendering.h>
+#include <WorldPartition/WorldPartitionSubsystem.h>
 
 #include "PortalCharacter.h"
+#include "PortalQualitySettings.h"
+#include "PortalRoomVolume.h"
+#include "PortalRenderTargetPool.h"
 #include "PortalTools.h"
+#include "PortalWorldSubsystem.h"
 #include "Portal.h"
+#include "PortalSceneCapture.h"
+#include "PortalStats.h"
 #include "TeleporterPortal.h"
 
 
+static TAutoConsoleVariable<float> CVarPortalGovernorTargetGPUTime(
+   TEXT("r.Portals.Governor.TargetGPUTime"),
+   -1.f,
+   TEXT("GPU frame time in ms above which the portal render depth and active distance are lowered. 0 to disable, negative to use the project settings."),
+   ECVF_Scalability);
+
+static TAutoConsoleVariable<int32> CVarPortalStreaming(
+   TEXT("r.Portals.Streaming"),
+   1,
+   TEXT("If set, the world around the destinations of the portals is streamed in from their virtual cameras."),
+   ECVF_Default);
+
+static TAutoConsoleVariable<int32> CVarPortalStreamingMaxHops(
+   TEXT("r.Portals.Streaming.MaxHops"),
+   2,
+   TEXT("Number of portals the destinations streamed in can be seen through."),
+   ECVF_Scalability);
+
+static TAutoConsoleVariable<int32> CVarPortalMaxCapturesPerFrame(
+   TEXT("r.Portals.MaxCapturesPerFrame"),
+   32,
+   TEXT("Maximum number of SceneCapture renders per frame. The least visible portals above it display their last texture."),
+   ECVF_Scalability);
+
+static TAutoConsoleVariable<float> CVarPortalCaptureBudgetMs(
+   TEXT("r.Portals.CaptureBudgetMs"),
+   0.f,
+   TEXT("Estimated GPU time in ms allowed for the portal captures every frame. 0 to disable."),
+   ECVF_Scalability);
+
+static TAutoConsoleVariable<int32> CVarPortalAsyncVisibilityTraces(
+   TEXT("r.Portals.AsyncVisibilityTraces"),
+   0,
+   TEXT("If set, the portal occlusion traces are asynchronous and their results used one frame later."),
+   ECVF_Default);
+
+static TAutoConsoleVariable<int32> CVarPortalParallelVisibility(
+   TEXT("r.Portals.ParallelVisibility"),
+   1,
+   TEXT("If set, the frustum tests of the portals seen by a camera run on the worker threads."),
+   ECVF_Default);
+
+static TAutoConsoleVariable<int32> CVarPortalParallelVisibilityMinPortals(
+   TEXT("r.Portals.ParallelVisibility.MinPortals"),
+   16,
+   TEXT("Number of portals tested from the same camera under which the frustum tests stay on the game thread."),
+   ECVF_Default);
+
+static TAutoConsoleVariable<int32> CVarPortalVisibilityCache(
+   TEXT("r.Portals.VisibilityCache"),
+   1,
+   TEXT("If set, the visible portals of the previous frame are reused while the camera and the portals don't move."),
+   ECVF_Default);
+
+static TAutoConsoleVariable<float> CVarPortalVisibilityCacheDistance(
+   TEXT("r.Portals.VisibilityCache.Distance"),
+   1.f,
+   TEXT("Distance in cm the camera can move before the portal visibility is computed again."),
+   ECVF_Default);
+
+static TAutoConsoleVariable<float> CVarPortalVisibilityCacheAngle(
+   TEXT("r.Portals.VisibilityCache.Angle"),
+   0.5f,
+   TEXT("Angle in degrees the camera can rotate before the portal visibility is computed again."),
+   ECVF_Default);
+
+static TAutoConsoleVariable<int32> CVarPortalVisibilityCacheMaxFrames(
+   TEXT("r.Portals.VisibilityCache.MaxFrames"),
+   30,
+   TEXT("Number of frames after which the portal visibility is computed again anyway, for moving occluders."),
+   ECVF_Default);
+
+static TAutoConsoleVariable<int32> CVarPortalMaxRenderTargetResizesPerFrame(
+   TEXT("r.Portals.RenderTarget.MaxResizesPerFrame"),
+   2,
+   TEXT("Maximum number of portal render targets resized every frame, the most visible portals being resized first."),
+   ECVF_Default);
+
+static TAutoConsoleVariable<int32> CVarPortalTemporalReuse(
+   TEXT("r.Portals.TemporalReuse"),
+   0,
+   TEXT("If set, small and deep portals are not captured every frame, their last texture is displayed reprojected in between.\n")
+   TEXT("Needs a portal material sampling the textures with their ViewProjection matrix, M_Portal samples them by screen position so the reused textures swim with the camera."),
+   ECVF_Scalability);
+
+static TAutoConsoleVariable<int32> CVarPortalTemporalReuseFramesPerDepth(
+   TEXT("r.Portals.TemporalReuse.FramesPerDepth"),
+   1,
+   TEXT("Frames added between two captures of a portal for every recursion level it is seen through."),
+   ECVF_Scalability);
+
+static TAutoConsoleVariable<float> CVarPortalTemporalReuseMinCoverage(
+   TEXT("r.Portals.TemporalReuse.MinCoverage"),
+   0.1f,
+   TEXT("Fraction of the screen under which a portal is captured one frame out of two more."),
+   ECVF_Scalability);
+
+static TAutoConsoleVariable<int32> CVarPortalTemporalReuseMaxInterval(
+   TEXT("r.Portals.TemporalReuse.MaxInterval"),
+   4,
+   TEXT("Maximum number of frames between two captures of a visible portal."),
+   ECVF_Scalability);
+
+static TAutoConsoleVariable<int32> CVarPortalShareCaptures(
+   TEXT("r.Portals.ShareCaptures"),
+   1,
+   TEXT("If set, identical captures of a frame are only rendered once: a portal seen from the same place by several views (split-screen)\n")
+   TEXT("or branches of a render tree, or SceneCaptures seeing through the same portal from the same place."),
+   ECVF_Default);
+
+static TAutoConsoleVariable<float> CVarPortalShareCapturesDistance(
+   TEXT("r.Portals.ShareCaptures.Distance"),
+   0.5f,
+   TEXT("Size in cm of the cells the virtual camera locations are rounded to, those in the same cell share their capture."),
+   ECVF_Default);
+
+static TAutoConsoleVariable<float> CVarPortalShareCapturesAngle(
+   TEXT("r.Portals.ShareCaptures.Angle"),
+   0.1f,
+   TEXT("Step in degrees the virtual camera rotations are rounded to, those rounded to the same one share their capture."),
+   ECVF_Default);
+
+static TAutoConsoleVariable<int32> CVarPortalStereo(
+   TEXT("r.Portals.Stereo"),
+   0,
+   TEXT("If set, the portals are captured for each eye with stereo rendering, sharing the visibility of the portals. Else they are captured from the center of the eyes.\n")
+   TEXT("Needs a portal material selecting the right eye textures (\"A right\"...), M_Portal shows the left eye ones in both eyes."),
+   ECVF_Default);
+
+static TAutoConsoleVariable<float> CVarPortalCaptureCostPerMegapixel(
+   TEXT("r.Portals.CaptureCostPerMegapixel"),
+   1.5f,
+   TEXT("Estimated GPU time in ms of a capture per million pixels of its render target, used by r.Portals.CaptureBudgetMs."),
+   ECVF_Default);
+
+
 // Sets default values
 APortalManager::APortalManager(const FObjectInitializer& ObjectInitializer) :
    Super(ObjectInitializer)
 {
-   PrimaryActorTick.bCanEverTick = true;
+   // Updated by the UPortalWorldSubsystem, after the gameplay ticks for the teleports of the frame to be rendered in the same frame
+   PrimaryActorTick.bCanEverTick = false;
 }
 
 
@@ -23,92 +179,1594 @@ void APortalManager::BeginPlay()
 {
    Super::BeginPlay();
 
-   m_controller = UGameplayStatics::GetPlayerController(GetWorld(), 0);
-   AttachToActor(m_controller, FAttachmentTransformRules::SnapToTargetNotIncludingScale);
+   AttachToActor(UGameplayStatics::GetPlayerController(GetWorld(), 0), FAttachmentTransformRules::SnapToTargetNotIncludingScale);
+
+   if (UPortalWorldSubsystem* subsystem = GetWorld()->GetSubsystem<UPortalWorldSubsystem>())
+      subsystem->SetPortalManager(this);
+
+   // Only in World Partition worlds
+   if (UWorldPartitionSubsystem* world_partition_subsystem = GetWorld()->GetSubsystem<UWorldPartitionSubsystem>())
+      world_partition_subsystem->RegisterStreamingSourceProvider(this);
+}
+
+
+void APortalManager::EndPlay(const EEndPlayReason::Type EndPlayReason)
+{
+   UPortalWorldSubsystem* subsystem = GetWorld() ? GetWorld()->GetSubsystem<UPortalWorldSubsystem>() : nullptr;
+
+   if (subsystem && subsystem->GetPortalManager() == this)
+      subsystem->SetPortalManager(nullptr);
+
+   if (UWorldPartitionSubsystem* world_partition_subsystem = GetWorld() ? GetWorld()->GetSubsystem<UWorldPartitionSubsystem>() : nullptr)
+      world_partition_subsystem->UnregisterStreamingSourceProvider(this);
+
+   m_streaming_destinations.Reset();
+
+   Super::EndPlay(EndPlayReason);
 }
 
 
 void APortalManager::Init()
 {
+   // Portals spawned after this point register themselves in their BeginPlay
    for (TActorIterator<APortal> portals_it(GetWorld()); portals_it; ++portals_it)
+      RegisterPortal(*portals_it);
+
+   for (TActorIterator<APortalRoomVolume> rooms_it(GetWorld()); rooms_it; ++rooms_it)
+      RegisterRoom(*rooms_it);
+}
+
+
+void APortalManager::RegisterRoom(APortalRoomVolume* room)
+{
+   if (room)
+      m_rooms.AddUnique(room);
+}
+
+
+void APortalManager::GetRoomsAt(const FVector& location, TArray<APortalRoomVolume*>& OUT_rooms) const
+{
+   for (APortalRoomVolume* room : m_rooms)
+   {
+      if (IsValid(room) && room->EncompassesPoint(location))
+         OUT_rooms.Add(room);
+   }
+}
+
+
+void APortalManager::RegisterPortal(APortal* portal)
+{
+   if (!portal || m_portals.Contains(portal))
+      return;
+
+   m_portals.Add(portal);
+
+   if (ATeleporterPortal* teleporter = Cast<ATeleporterPortal>(portal))
+      m_teleporters.Add(teleporter);
+
+   portal->SetPortalManager(this);
+   portal->SetSceneCaptures();
+
+   TArray<APlayerController*> view_controllers;
+   for (const FPortalView& view : m_views)
+      view_controllers.Add(view.controller.Get());
+
+   portal->SetViews(view_controllers);
+
+   MarkVisibilityGraphDirty();
+}
+
+
+void APortalManager::NotifyPortalMoved(APortal* portal)
+{
+   if (portal)
+      m_moved_portals.Add(portal);
+}
+
+
+void APortalManager::UnregisterPortal(APortal* portal)
+{
+   m_moved_portals.Remove(portal);
+   m_teleporters.Remove(Cast<ATeleporterPortal>(portal));
+
+   UPortalRenderTargetPool* render_target_pool = GetWorld() ? GetWorld()->GetSubsystem<UPortalRenderTargetPool>() : nullptr;
+
+   for (FPortalView& view : m_views)
+   {
+      view.portal_texture_states.Remove(portal);
+
+      TArray<UTextureRenderTarget2D*> render_targets;
+      if (view.portal_render_targets.RemoveAndCopyValue(portal, render_targets) && render_target_pool)
+      {
+         for (UTextureRenderTarget2D* render_target : render_targets)
+            render_target_pool->ReleaseRenderTarget(render_target);
+      }
+   }
+
+   if (m_portals.Remove(portal) > 0)
    {
-      APortal* portal = *portals_it;
-      portal->SetSceneCaptures();
+      MarkVisibilityGraphDirty();
+
+      // The render trees may point to the portal
+      for (FPortalView& view : m_views)
+         view.is_render_tree_valid = false;
+
+      // The cache is keyed by pointers, which could be reused
+      m_async_visibility.Reset();
    }
 }
 
 
-void APortalManager::Tick(float DeltaSeconds)
+void APortalManager::Update(float DeltaSeconds)
 {
-   Super::Tick(DeltaSeconds);
+   // Teleport first, for the portals to be rendered from where the players now are
+   UpdateCrossings();
+
+   UpdateGovernor();
 
    // Find portals in the level and update them
    UpdateVisiblePortals();
+
+   // After the visibility graph is brought up to date by the render
+   UpdateStreaming();
 }
 
 
-void APortalManager::RequestTeleportByPortal(ATeleporterPortal* portal, AActor* target_to_teleport) const
+void APortalManager::UpdateCrossings()
 {
-   if (portal && target_to_teleport && m_controller)
+   SCOPE_CYCLE_COUNTER(STAT_PortalUpdateCrossings);
+   TRACE_CPUPROFILER_EVENT_SCOPE(APortalManager::UpdateCrossings);
+
+   // Teleports change the tracked actors of the teleporters, they are only done once every teleporter is updated
+   TArray<TPair<ATeleporterPortal*, AActor*>> crossings;
+   TArray<AActor*> crossing_actors;
+
+   for (ATeleporterPortal* teleporter : m_teleporters)
    {
-      portal->TeleportActor(target_to_teleport);
+      if (!teleporter || !teleporter->HasTrackedActors())
+         continue;
 
-      UpdateVisiblePortals();
+      crossing_actors.Reset();
+      teleporter->UpdateCrossings(crossing_actors);
+
+      // An actor going through two teleporters at once only takes the first one
+      for (AActor* actor : crossing_actors)
+      {
+         if (!crossings.ContainsByPredicate([actor](const TPair<ATeleporterPortal*, AActor*>& crossing) { return crossing.Value == actor; }))
+            crossings.Emplace(teleporter, actor);
+      }
    }
+
+   for (const TPair<ATeleporterPortal*, AActor*>& crossing : crossings)
+      crossing.Key->TeleportActor(crossing.Value);
+
+   INC_DWORD_STAT_BY(STAT_PortalTeleports, crossings.Num());
 }
 
 
-void APortalManager::UpdateVisiblePortals() const
+void APortalManager::UpdateGovernor()
 {
-   if (!m_controller)
+   const UPortalQualitySettings* settings = GetDefault<UPortalQualitySettings>();
+
+   const float target_gpu_time_cvar = CVarPortalGovernorTargetGPUTime.GetValueOnGameThread();
+   const float target_gpu_time = target_gpu_time_cvar >= 0.f ? target_gpu_time_cvar : settings->GetGovernorTargetGPUTime();
+
+   if (target_gpu_time <= 0.f)
+   {
+      m_governor_level = 0;
+      m_smoothed_gpu_time = 0.f;
       return;
+   }
 
-   const APortalCharacter* character = Cast<APortalCharacter>(m_controller->GetCharacter());
-   if (!character)
+   // Time of a frame the GPU finished, one or two frames behind the game thread
+   const float gpu_time = FPlatformTime::ToMilliseconds(RHIGetGPUFrameCycles());
+   if (gpu_time <= 0.f)
+      return;
+
+   // Smoothed so that a single slow frame does not change the level
+   m_smoothed_gpu_time = m_smoothed_gpu_time > 0.f ? FMath::Lerp(m_smoothed_gpu_time, gpu_time, 0.1f) : gpu_time;
+
+   if (++m_frames_since_governor_change < settings->GetGovernorFramesBetweenChanges())
+      return;
+
+   const int32 previous_level = m_governor_level;
+
+   if (m_smoothed_gpu_time > target_gpu_time)
+      m_governor_level = FMath::Min(m_governor_level + 1, FMath::Max(settings->GetGovernorMaxLevel(), 0));
+
+   else if (m_smoothed_gpu_time < target_gpu_time * settings->GetGovernorHeadroom())
+      m_governor_level = FMath::Max(m_governor_level - 1, 0);
+
+   if (m_governor_level == previous_level)
+      return;
+
+   m_frames_since_governor_change = 0;
+
+   // The render trees were built with the previous depth and distance
+   for (FPortalView& view : m_views)
+      view.is_render_tree_valid = false;
+}
+
+
+unsigned int APortalManager::GetMaxRenderDepth() const
+{
+   const int32 max_render_depth = int32(APortal::GetMaxRenderDepth());
+
+   // The governor never goes below its min depth, nor raises the depth up to it
+   const int32 min_render_depth = FMath::Min(GetDefault<UPortalQualitySettings>()->GetGovernorMinRenderDepth(), max_render_depth);
+
+   return static_cast<unsigned int>(FMath::Max(max_render_depth - m_governor_level, min_render_depth));
+}
+
+
+float APortalManager::GetActivePortalDistance() const
+{
+   const UPortalQualitySettings* settings = GetDefault<UPortalQualitySettings>();
+   const int32 max_level = settings->GetGovernorMaxLevel();
+
+   if (m_governor_level == 0 || max_level <= 0)
+      return float(APortal::GetActivePortalDistance());
+
+   const float fraction = FMath::Lerp(1.f, settings->GetGovernorMinDistanceFraction(), float(m_governor_level) / float(max_level));
+
+   return float(APortal::GetActivePortalDistance()) * fraction;
+}
+
+
+void APortalManager::GetReachableDestinations(int32 max_hops, TArray<FPortalDestination>& OUT_destinations) const
+{
+   OUT_destinations.Reset();
+
+   if (max_hops <= 0)
+      return;
+
+   // Portal to go through and where it is seen from
+   struct FHop
+   {
+      const APortal* portal;
+      FTransform watched_actor_transform;
+      int32 nb_hops;
+   };
+
+   TArray<FHop> hops;
+
+   // Lowered with the render distance by the governor, nothing further is rendered anyway
+   const float active_distance = GetActivePortalDistance();
+
+   for (const FPortalView& view : m_views)
+   {
+      const APlayerController* controller = view.controller.Get();
+      const APortalCharacter* character = controller ? Cast<APortalCharacter>(controller->GetCharacter()) : nullptr;
+
+      if (!character)
+         continue;
+
+      const FTransform camera_transform = character->GetPlayerCamera()->GetComponentTransform();
+
+      TArray<APortal*> portals_in_range;
+      GatherPortalsInRange(camera_transform.GetLocation(), active_distance, portals_in_range);
+
+      for (const APortal* portal : portals_in_range)
+      {
+         if (FVector::DotProduct(portal->GetActorForwardVector(), camera_transform.GetLocation() - portal->GetActorLocation()) > 0)
+            hops.Add({ portal, camera_transform, 1 });
+      }
+   }
+
+   // Going breadth-first, every destination is first reached through its lowest number of portals
+   TSet<const UPortalSceneCapture*> visited_scene_captures;
+   TSet<const APortal*> reached_portals;
+
+   for (int32 hop_index = 0; hop_index < hops.Num(); ++hop_index)
+   {
+      // Copied, adding the next hops can reallocate the array
+      const FHop hop = hops[hop_index];
+
+      for (const UPortalSceneCapture* scene_capture : hop.portal->GetSceneCaptures())
+      {
+         bool is_visited = false;
+         visited_scene_captures.Add(scene_capture, &is_visited);
+
+         if (is_visited)
+            continue;
+
+         const FTransform camera_transform = Tools::ComputeNewTransform(hop.watched_actor_transform, hop.portal, scene_capture);
+         const APortal* linked_portal = scene_capture->GetLinkedPortal();
+
+         // Holes and mirrors show the surroundings of the portal itself
+         if (linked_portal && scene_capture->GetTrueType() == ECameraType::Portal && !reached_portals.Contains(linked_portal))
+         {
+            reached_portals.Add(linked_portal);
+            OUT_destinations.Add({ linked_portal, camera_transform, hop.nb_hops });
+         }
+
+         if (hop.nb_hops >= max_hops)
+            continue;
+
+         for (const APortal* candidate : GetVisibilityCandidates(scene_capture))
+            hops.Add({ candidate, camera_transform, hop.nb_hops + 1 });
+      }
+   }
+}
+
+
+void APortalManager::UpdateStreaming()
+{
+   SCOPE_CYCLE_COUNTER(STAT_PortalUpdateStreaming);
+   TRACE_CPUPROFILER_EVENT_SCOPE(APortalManager::UpdateStreaming);
+
+   if (!CVarPortalStreaming.GetValueOnGameThread())
+   {
+      m_streaming_destinations.Reset();
+      return;
+   }
+
+   GetReachableDestinations(CVarPortalStreamingMaxHops.GetValueOnGameThread(), m_streaming_destinations);
+
+   // The textures and meshes seen through the portals stream in as if a player stood at the virtual cameras, less so through more portals
+   IStreamingManager& streaming_manager = IStreamingManager::Get();
+
+   for (const FPortalDestination& destination : m_streaming_destinations)
+      streaming_manager.AddViewLocation(destination.camera_transform.GetLocation(), 1.f / float(destination.nb_hops));
+
+   INC_DWORD_STAT_BY(STAT_PortalStreamingDestinations, m_streaming_destinations.Num());
+}
+
+
+bool APortalManager::GetStreamingSource(FWorldPartitionStreamingSource& OutStreamingSource)
+{
+   // Without destinations, the cells only seen through portals are unloaded like any other the players are away from
+   if (m_streaming_destinations.Num() == 0)
+      return false;
+
+   const FVector origin = m_streaming_destinations[0].camera_transform.GetLocation();
+   int32 min_hops = m_streaming_destinations[0].nb_hops;
+
+   OutStreamingSource.Name = GetFName();
+   OutStreamingSource.Location = origin;
+   OutStreamingSource.Rotation = FRotator::ZeroRotator;
+   OutStreamingSource.TargetState = EStreamingSourceTargetState::Activated;
+   OutStreamingSource.Shapes.Reset(m_streaming_destinations.Num());
+
+   // One shape per destination, relative to the source and loading the cells in the grid loading range around its virtual camera
+   for (const FPortalDestination& destination : m_streaming_destinations)
+   {
+      FStreamingSourceShape& shape = OutStreamingSource.Shapes.AddDefaulted_GetRef();
+      shape.Location = destination.camera_transform.GetLocation() - origin;
+
+      min_hops = FMath::Min(min_hops, destination.nb_hops);
+   }
+
+   // Destinations seen directly load along with the surroundings of the players, those seen through several portals after them
+   OutStreamingSource.Priority = min_hops <= 1 ? EStreamingSourcePriority::Normal : EStreamingSourcePriority::Low;
+
+   return true;
+}
+
+
+void APortalManager::RequestTeleportByPortal(ATeleporterPortal* portal, AActor* target_to_teleport)
+{
+   // The portal notifies the teleport, which is taken into account by the next render instead of rendering all the portals again now
+   if (portal && target_to_teleport)
+      portal->TeleportActor(target_to_teleport);
+}
+
+
+void APortalManager::NotifyActorTeleported(const AActor* actor)
+{
+   bool is_view_teleported = false;
+
+   for (FPortalView& view : m_views)
+   {
+      const APlayerController* controller = view.controller.Get();
+      if (!controller || controller->GetPawn() != actor)
+         continue;
+
+      // Nothing captured from the previous location can be displayed from the new one
+      view.is_render_tree_valid = false;
+      view.portal_texture_states.Reset();
+
+      is_view_teleported = true;
+   }
+
+   // The occlusion results of the last frame were computed from the previous location, every portal is visible until new ones are known
+   if (is_view_teleported)
+      m_async_visibility.Reset();
+}
+
+
+void APortalManager::UpdateVisiblePortals()
+{
+   SCOPE_CYCLE_COUNTER(STAT_PortalUpdateVisiblePortals);
+   TRACE_CPUPROFILER_EVENT_SCOPE(APortalManager::UpdateVisiblePortals);
+
+   UpdateViews();
+
+   if (m_views.Num() == 0)
       return;
 
-   FVector player_location = character->GetActorLocation();
+   // If a portal moved or a link changed, what was visible may not be anymore
+   // The grid and the candidates of the SceneCaptures depend on the active distance, which can be changed at runtime
+   if (m_grid_cell_size != FMath::Max(1.f, float(APortal::GetActivePortalDistance())))
+      m_is_visibility_graph_dirty = true;
+
+   if (m_is_visibility_graph_dirty || m_moved_portals.Num() > 0)
+   {
+      for (FPortalView& view : m_views)
+         view.is_render_tree_valid = false;
+   }
+
+   if (m_is_visibility_graph_dirty)
+      RebuildVisibilityGraph();
+
+   else if (m_moved_portals.Num() > 0)
+      UpdateMovedPortals();
 
    ClearAllPortals();
 
-   TArray<APortal*> visible_portals;
+   m_shared_captures.Reset();
+   m_shared_scene_captures.Reset();
 
-   for (TActorIterator<APortal> portals_it(GetWorld()); portals_it; ++portals_it)
+   int32 resize_budget = CVarPortalMaxRenderTargetResizesPerFrame.GetValueOnGameThread();
+
+   // The captures see the portal meshes, which display the textures of the first view, so it is rendered last
+   for (int32 view_index = m_views.Num() - 1; view_index >= 0; --view_index)
+      RenderView(m_views[view_index], resize_budget);
+
+   TSet<const APortal*> visible_portals;
+   unsigned int max_depth = 0;
+   m_capture_count = 0;
+
+   for (const FPortalView& view : m_views)
+   {
+      for (const FPortalRenderNode& node : view.render_nodes)
+      {
+         if (!node.is_scheduled)
+            continue;
+
+         visible_portals.Add(node.portal);
+         max_depth = FMath::Max(max_depth, node.depth);
+
+         if (node.is_reused || node.is_shared)
+            continue;
+
+         const int32 nb_scene_captures = node.portal->GetSceneCaptures().Num();
+
+         // Neither the shared captures nor the ones the portal skips are rendered
+         for (int32 i = 0; i < node.render_targets.Num(); ++i)
+         {
+            if (!(node.is_capture_shared.IsValidIndex(i) && node.is_capture_shared[i]) && !node.portal->IsSceneCaptureSkipped(i % FMath::Max(nb_scene_captures, 1)))
+               ++m_capture_count;
+         }
+      }
+   }
+
+   SET_DWORD_STAT(STAT_PortalsVisible, visible_portals.Num());
+   SET_DWORD_STAT(STAT_PortalMaxDepth, max_depth);
+
+   // The captures using them are already queued, they can be reused
+   if (UPortalRenderTargetPool* render_target_pool = GetWorld()->GetSubsystem<UPortalRenderTargetPool>())
    {
-      APortal* portal = *portals_it;
-      UCameraComponent* camera = character->GetPlayerCamera();
+      for (UTextureRenderTarget2D* leased_render_target : m_leased_render_targets)
+         render_target_pool->ReleaseRenderTarget(leased_render_target);
 
-      // If the portal is on screen, render it
-      if (Tools::isPortalVisibleToCamera(portal, camera))
-         portal->Render(camera->GetComponentTransform(), GetCameraProjectionMatrix(), 0);
+      render_target_pool->TrimFreeRenderTargets();
    }
+
+   m_leased_render_targets.Reset();
 }
 
 
-void APortalManager::ClearAllPortals() const
+void APortalManager::UpdateViews()
 {
-   for (TActorIterator<APortal> portals_it(GetWorld()); portals_it; ++portals_it)
+   TArray<APlayerController*> view_controllers;
+
+   for (FConstPlayerControllerIterator controllers_it = GetWorld()->GetPlayerControllerIterator(); controllers_it; ++controllers_it)
    {
-      APortal* portal = *portals_it;
+      APlayerController* controller = controllers_it->Get();
 
-      portal->SetActive(false);
-      portal->SetIsRendererButNotCaptured(false);
+      // Only the players of this machine have a screen to render to
+      if (controller && controller->IsLocalController() && controller->GetLocalPlayer())
+         view_controllers.Add(controller);
+   }
+
+   bool are_views_changed = view_controllers.Num() != m_views.Num();
+
+   for (int32 view_index = 0; !are_views_changed && view_index < m_views.Num(); ++view_index)
+      are_views_changed = m_views[view_index].controller.Get() != view_controllers[view_index];
+
+   if (!are_views_changed)
+      return;
+
+   for (FPortalView& view : m_views)
+      ReleaseViewRenderTargets(view);
+
+   m_views.Reset();
+
+   for (int32 view_index = 0; view_index < view_controllers.Num(); ++view_index)
+   {
+      FPortalView& view = m_views.AddDefaulted_GetRef();
+      view.controller = view_controllers[view_index];
+      view.index = view_index;
    }
+
+   for (APortal* portal : m_portals)
+      portal->SetViews(view_controllers);
 }
 
 
-FMatrix APortalManager::GetCameraProjectionMatrix() const 
+void APortalManager::ReleaseViewRenderTargets(FPortalView& view) const
 {
-   FMatrix projection_matrix;
-   ULocalPlayer* local_player = m_controller->GetLocalPlayer();
+   UPortalRenderTargetPool* render_target_pool = GetWorld()->GetSubsystem<UPortalRenderTargetPool>();
 
-   if (local_player)
+   if (render_target_pool)
    {
-      FSceneViewProjectionData player_projection_data;
-      local_player->GetProjectionData(local_player->ViewportClient->Viewport, player_projection_data, INDEX_NONE);
+      for (auto& portal_render_targets : view.portal_render_targets)
+      {
+         for (UTextureRenderTarget2D* render_target : portal_render_targets.Value)
+            render_target_pool->ReleaseRenderTarget(render_target);
+      }
+   }
 
-      projection_matrix = player_projection_data.ProjectionMatrix;
+   view.portal_render_targets.Reset();
+}
+
+
+void APortalManager::RenderView(FPortalView& view, int32& inout_resize_budget)
+{
+   const APlayerController* controller = view.controller.Get();
+   if (!controller)
+      return;
+
+   const APortalCharacter* character = Cast<APortalCharacter>(controller->GetCharacter());
+   if (!character)
+      return;
+
+   UCameraComponent* camera = character->GetPlayerCamera();
+   const FTransform camera_transform = camera->GetComponentTransform();
+   const FMatrix projection_matrix = GetCameraProjectionMatrix(controller);
+
+   const int32 previous_nb_eyes = view.eye_transforms.Num();
+   UpdateEyes(view, camera_transform, projection_matrix);
+
+   // The textures and their last captures are laid out for the previous number of eyes
+   if (previous_nb_eyes != 0 && previous_nb_eyes != view.eye_transforms.Num())
+   {
+      ReleaseViewRenderTargets(view);
+      view.portal_texture_states.Reset();
    }
 
-   return projection_matrix;
+   view.viewport_size = GetViewSize(controller);
+
+   // Each eye gets one half of the screen
+   if (view.eye_transforms.Num() > 1)
+      view.viewport_size.X *= 0.5f;
+
+   if (CanReuseRenderTree(view, camera_transform, projection_matrix))
+   {
+      RefreshRenderTree(view, camera_transform, projection_matrix);
+      view.render_tree_age++;
+   }
+   else
+   {
+      BuildRenderTree(view, camera, projection_matrix);
+
+      view.render_tree_camera_transform = camera_transform;
+      view.render_tree_projection_matrix = projection_matrix;
+      view.render_tree_age = 0;
+      view.is_render_tree_valid = true;
+   }
+
+   UpdateEyeTransforms(view);
+
+   RenderTree(view, projection_matrix, inout_resize_budget);
+}
+
+
+void APortalManager::UpdateEyes(FPortalView& view, const FTransform& camera_transform, const FMatrix& projection_matrix)
+{
+   view.eye_transforms.Reset();
+   view.eye_projection_matrices.Reset();
+
+   const APlayerController* controller = view.controller.Get();
+   const ULocalPlayer* local_player = controller ? controller->GetLocalPlayer() : nullptr;
+   FViewport* viewport = (local_player && local_player->ViewportClient) ? local_player->ViewportClient->Viewport : nullptr;
+
+   FSceneViewProjectionData center_projection_data;
+   const bool is_stereo = CVarPortalStereo.GetValueOnGameThread() && viewport && GEngine && GEngine->IsStereoscopic3D(viewport)
+                          && local_player->GetProjectionData(viewport, center_projection_data, INDEX_NONE);
+
+   if (!is_stereo)
+   {
+      view.eye_transforms.Add(camera_transform);
+      view.eye_projection_matrices.Add(projection_matrix);
+      return;
+   }
+
+   for (const int32 eye : { int32(eSSE_LEFT_EYE), int32(eSSE_RIGHT_EYE) })
+   {
+      FSceneViewProjectionData eye_projection_data;
+      local_player->GetProjectionData(viewport, eye_projection_data, eye);
+
+      // Offset of the eye from the center of the head, applied to the camera the portals are seen from
+      FTransform eye_transform = camera_transform;
+      eye_transform.AddToTranslation(eye_projection_data.ViewOrigin - center_projection_data.ViewOrigin);
+
+      view.eye_transforms.Add(eye_transform);
+      view.eye_projection_matrices.Add(eye_projection_data.ProjectionMatrix);
+   }
+}
+
+
+void APortalManager::UpdateEyeTransforms(FPortalView& view)
+{
+   const int32 nb_eyes = view.eye_transforms.Num();
+
+   // Parents being stored first, the transforms of their eyes are always known when placing their SCs
+   for (FPortalRenderNode& node : view.render_nodes)
+   {
+      if (node.parent == INDEX_NONE)
+         node.eye_watched_actor_transforms = view.eye_transforms;
+
+      else if (nb_eyes == 1)
+      {
+         node.eye_watched_actor_transforms.Reset();
+         node.eye_watched_actor_transforms.Add(node.watched_actor_transform);
+      }
+
+      node.eye_capture_rects.SetNum(nb_eyes);
+
+      for (int32 eye_index = 0; eye_index < nb_eyes; ++eye_index)
+      {
+         FBox2D& capture_rect = node.eye_capture_rects[eye_index];
+         capture_rect = UPortalSceneCapture::ComputeCaptureRect(node.portal, node.eye_watched_actor_transforms[eye_index], view.eye_projection_matrices[eye_index]);
+
+         // Only what is seen through the capture of the parent is needed
+         if (node.parent != INDEX_NONE)
+         {
+            const FBox2D& parent_capture_rect = view.render_nodes[node.parent].eye_capture_rects[eye_index];
+            capture_rect = capture_rect.Intersect(parent_capture_rect) ? capture_rect.Overlap(parent_capture_rect) : parent_capture_rect;
+         }
+      }
+
+      // Without stereo rendering, the single eye is where the tree was built from
+      if (nb_eyes == 1 || !node.is_scheduled || node.children.Num() == 0)
+         continue;
+
+      for (int32 eye_index = 0; eye_index < nb_eyes; ++eye_index)
+      {
+         node.portal->UpdateCaptureViews(node.eye_watched_actor_transforms[eye_index], view.eye_projection_matrices[eye_index]);
+
+         for (int32 child_index : node.children)
+         {
+            FPortalRenderNode& child = view.render_nodes[child_index];
+
+            child.eye_watched_actor_transforms.SetNum(nb_eyes);
+            child.eye_watched_actor_transforms[eye_index] = node.portal->GetSceneCaptures()[child.parent_scene_capture]->GetComponentTransform();
+         }
+      }
+   }
+}
+
+
+bool APortalManager::CanReuseRenderTree(const FPortalView& view, const FTransform& camera_transform, const FMatrix& projection_matrix)
+{
+   if (!view.is_render_tree_valid || !CVarPortalVisibilityCache.GetValueOnGameThread())
+      return false;
+
+   if (view.render_tree_age >= CVarPortalVisibilityCacheMaxFrames.GetValueOnGameThread())
+      return false;
+
+   if (!projection_matrix.Equals(view.render_tree_projection_matrix))
+      return false;
+
+   const float max_distance = CVarPortalVisibilityCacheDistance.GetValueOnGameThread();
+   if (FVector::DistSquared(camera_transform.GetLocation(), view.render_tree_camera_transform.GetLocation()) > max_distance * max_distance)
+      return false;
+
+   const float max_angle = FMath::DegreesToRadians(CVarPortalVisibilityCacheAngle.GetValueOnGameThread());
+   return camera_transform.GetRotation().AngularDistance(view.render_tree_camera_transform.GetRotation()) <= max_angle;
+}
+
+
+void APortalManager::RefreshRenderTree(FPortalView& view, const FTransform& camera_transform, const FMatrix& projection_matrix)
+{
+   // Parents being stored first, their watched actor transform is always up to date when placing their SCs
+   for (FPortalRenderNode& node : view.render_nodes)
+   {
+      node.render_targets.Reset();
+
+      if (node.parent == INDEX_NONE)
+         node.watched_actor_transform = camera_transform;
+
+      if (!node.is_scheduled || node.children.Num() == 0)
+         continue;
+
+      node.portal->UpdateCaptureViews(node.watched_actor_transform, projection_matrix);
+
+      for (int32 child_index : node.children)
+      {
+         FPortalRenderNode& child = view.render_nodes[child_index];
+         child.watched_actor_transform = node.portal->GetSceneCaptures()[child.parent_scene_capture]->GetComponentTransform();
+      }
+   }
+}
+
+
+void APortalManager::ClearAllPortals() const
+{
+   for (APortal* portal : m_portals)
+      portal->SetActive(false);
+}
+
+
+FMatrix APortalManager::GetCameraProjectionMatrix(const APlayerController* controller)
+{
+   FMatrix projection_matrix;
+   ULocalPlayer* local_player = controller->GetLocalPlayer();
+
+   if (local_player)
+   {
+      FSceneViewProjectionData player_projection_data;
+      local_player->GetProjectionData(local_player->ViewportClient->Viewport, player_projection_data, INDEX_NONE);
+
+      projection_matrix = player_projection_data.ProjectionMatrix;
+   }
+
+   return projection_matrix;
+}
+
+
+FVector2D APortalManager::GetViewSize(const APlayerController* controller)
+{
+   const ULocalPlayer* local_player = controller->GetLocalPlayer();
+
+   if (!local_player || !local_player->ViewportClient)
+      return UPortalSceneCapture::GetGameViewportSize();
+
+   FVector2D viewport_size;
+   local_player->ViewportClient->GetViewportSize(viewport_size);
+
+   // Fraction of the viewport given to the player by the split-screen layout
+   return viewport_size * local_player->Size;
+}
+
+
+void APortalManager::BuildRenderTree(FPortalView& view, UCameraComponent* camera, const FMatrix& projection_matrix)
+{
+   SCOPE_CYCLE_COUNTER(STAT_PortalBuildRenderTree);
+   TRACE_CPUPROFILER_EVENT_SCOPE(APortalManager::BuildRenderTree);
+
+   TArray<FPortalRenderNode>& render_nodes = view.render_nodes;
+   render_nodes.Reset();
+
+   const FTransform camera_transform = camera->GetComponentTransform();
+
+   m_async_visibility.RemoveStaleEntries();
+
+   // Portals further than the active distance are never rendered
+   TArray<APortal*> portals_in_range;
+   GatherPortalsInRange(camera->GetComponentLocation(), GetActivePortalDistance(), portals_in_range);
+
+   TArray<APortal*> visible_portals;
+   ComputeVisiblePortals(portals_in_range, camera, 0, 0.f, visible_portals);
+
+   // If the portal is on screen, render it
+   for (APortal* portal : visible_portals)
+   {
+      FBox2D screen_rect;
+      if (!Tools::ComputePortalScreenRect(portal, camera_transform, projection_matrix, screen_rect))
+         screen_rect = FBox2D(ForceInit);
+
+      AddRenderNode(view, portal, camera_transform, INDEX_NONE, INDEX_NONE, 0, screen_rect.bIsValid ? screen_rect.GetArea() / 4.f : 0.f, screen_rect);
+   }
+
+   // The quality of the portals seen directly also limits how deep the tree can go
+   const unsigned int max_render_depth = FMath::Min(GetMaxRenderDepth(), static_cast<unsigned int>(FMath::Max(GetDefault<UPortalQualitySettings>()->GetTier(0).max_render_depth, 0)));
+
+   // The budget is shared by the views, captures shared between them being counted once per view
+   const int32 nb_views = FMath::Max(m_views.Num(), 1);
+   const int32 max_captures = FMath::Max(CVarPortalMaxCapturesPerFrame.GetValueOnGameThread() / nb_views, 1);
+   const float capture_budget_ms = CVarPortalCaptureBudgetMs.GetValueOnGameThread() / nb_views;
+
+   int32 nb_captures = 0;
+   float captures_cost_ms = 0.f;
+
+   // Every iteration handles one depth level, whose nodes are stored between level_start and the end of the array
+   int32 level_start = 0;
+
+   while (level_start < render_nodes.Num())
+   {
+      const int32 level_end = render_nodes.Num();
+
+      // The portals covering the most of the screen are the first to get a share of the budget
+      TArrayView<FPortalRenderNode> level_nodes = MakeArrayView(render_nodes.GetData() + level_start, level_end - level_start);
+      Algo::Sort(level_nodes, [](const FPortalRenderNode& a, const FPortalRenderNode& b) { return a.coverage > b.coverage; });
+
+      for (int32 node_index = level_start; node_index < level_end; ++node_index)
+      {
+         const APortal* portal = render_nodes[node_index].portal;
+         const int32 node_captures = portal->GetRenderedSceneCaptureCount() * view.eye_transforms.Num();
+         const float node_cost_ms = EstimateCaptureCost(portal) * view.eye_transforms.Num();
+
+         // Over budget, the parent will display the last texture of the portal
+         if (nb_captures + node_captures > max_captures)
+            continue;
+
+         if (capture_budget_ms > 0.f && captures_cost_ms + node_cost_ms > capture_budget_ms)
+            continue;
+
+         nb_captures += node_captures;
+         captures_cost_ms += node_cost_ms;
+
+         render_nodes[node_index].is_scheduled = true;
+
+         // If we reached the max depth, we directly capture the scene
+         if (render_nodes[node_index].depth < max_render_depth)
+            ExpandRenderNode(view, node_index, projection_matrix);
+      }
+
+      level_start = level_end;
+   }
+
+   // Nodes don't move anymore, we can link them to their parent
+   for (int32 node_index = 0; node_index < render_nodes.Num(); ++node_index)
+   {
+      if (render_nodes[node_index].parent != INDEX_NONE)
+         render_nodes[render_nodes[node_index].parent].children.Add(node_index);
+   }
+}
+
+
+void APortalManager::ExpandRenderNode(FPortalView& view, int32 node_index, const FMatrix& projection_matrix)
+{
+   // Copies, the array may grow while adding the children
+   APortal* portal = view.render_nodes[node_index].portal;
+   const unsigned int depth = view.render_nodes[node_index].depth;
+   const uint32 path_hash = view.render_nodes[node_index].path_hash;
+   const float coverage = view.render_nodes[node_index].coverage;
+   const FBox2D parent_screen_rect = view.render_nodes[node_index].screen_rect;
+
+   // Only the views are needed to test the visibility of the children
+   portal->UpdateCaptureViews(view.render_nodes[node_index].watched_actor_transform, projection_matrix);
+
+   // A portal can only display one texture, so it is added once even if visible through several SCs
+   TSet<APortal*> visible_portals;
+
+   TArray<APortal*> candidates;
+   TArray<APortal*> visible_candidates;
+
+   for (int32 scene_capture_index = 0; scene_capture_index < portal->GetSceneCaptures().Num(); ++scene_capture_index)
+   {
+      UPortalSceneCapture* scene_capture = portal->GetSceneCaptures()[scene_capture_index];
+
+      // The candidates never contain the portal linked to the SC
+      candidates.Reset();
+      for (APortal* candidate : GetVisibilityCandidates(scene_capture))
+      {
+         if (!visible_portals.Contains(candidate))
+            candidates.Add(candidate);
+      }
+
+      // Distance between the camera and the linked portal
+      const float near_plane_distance = FMath::Abs(FVector::Dist(scene_capture->GetComponentLocation(), scene_capture->GetLinkedPortal()->GetActorLocation()));
+
+      ComputeVisiblePortals(candidates, scene_capture, path_hash, near_plane_distance, visible_candidates);
+
+      const FTransform scene_capture_transform = scene_capture->GetComponentTransform();
+
+      for (APortal* candidate : visible_candidates)
+      {
+         FBox2D candidate_screen_rect;
+         float candidate_coverage = 0.f;
+
+         // The texture of the portal is mapped on the screen, so the candidate is only seen where both overlap
+         if (Tools::ComputePortalScreenRect(candidate, scene_capture_transform, projection_matrix, candidate_screen_rect))
+         {
+            candidate_coverage = candidate_screen_rect.GetArea() / 4.f;
+            candidate_screen_rect = candidate_screen_rect.Intersect(parent_screen_rect) ? candidate_screen_rect.Overlap(parent_screen_rect) : FBox2D(ForceInit);
+         }
+         else
+            candidate_screen_rect = FBox2D(ForceInit);
+
+         visible_portals.Add(candidate);
+
+         // Seen through the portal, the candidate can't cover more than the portal itself
+         AddRenderNode(view, candidate, scene_capture_transform, node_index, scene_capture_index, depth + 1, FMath::Min(coverage, coverage * candidate_coverage), candidate_screen_rect);
+      }
+   }
+}
+
+
+void APortalManager::AddRenderNode(FPortalView& view, APortal* portal, const FTransform& watched_actor_transform, int32 parent, int32 parent_scene_capture, unsigned int depth, float coverage, const FBox2D& screen_rect)
+{
+   FPortalRenderNode& node = view.render_nodes.AddDefaulted_GetRef();
+
+   node.portal = portal;
+   node.watched_actor_transform = watched_actor_transform;
+   node.parent = parent;
+   node.parent_scene_capture = parent_scene_capture;
+   node.depth = depth;
+
+   const uint32 portal_hash = HashCombine(GetTypeHash(portal), GetTypeHash(parent_scene_capture));
+   node.path_hash = parent != INDEX_NONE ? HashCombine(view.render_nodes[parent].path_hash, portal_hash) : portal_hash;
+   node.coverage = coverage;
+   node.screen_rect = screen_rect;
+}
+
+
+void APortalManager::RenderTree(FPortalView& view, const FMatrix& projection_matrix, int32& inout_resize_budget)
+{
+   SCOPE_CYCLE_COUNTER(STAT_PortalRenderTree);
+   TRACE_CPUPROFILER_EVENT_SCOPE(APortalManager::RenderTree);
+
+   UPortalRenderTargetPool* render_target_pool = GetWorld()->GetSubsystem<UPortalRenderTargetPool>();
+   TArray<FPortalRenderNode>& render_nodes = view.render_nodes;
+
+   const int32 nb_eyes = view.eye_transforms.Num();
+
+   // Node using the textures owned by each portal, its most visible one. Other nodes of the same portal lease temporary ones
+   TMap<APortal*, int32> own_nodes;
+
+   for (int32 node_index = 0; node_index < render_nodes.Num(); ++node_index)
+   {
+      FPortalRenderNode& node = render_nodes[node_index];
+
+      node.is_reused = false;
+      node.is_shared = false;
+      node.is_capture_shared.Reset();
+
+      if (!node.is_scheduled)
+         continue;
+
+      // What is seen through a reused or shared texture doesn't need to be captured either
+      if (node.parent != INDEX_NONE && (render_nodes[node.parent].is_reused || render_nodes[node.parent].is_shared))
+      {
+         node.is_reused = render_nodes[node.parent].is_reused;
+         node.is_shared = render_nodes[node.parent].is_shared;
+         continue;
+      }
+
+      const FPortalSharedCapture* shared_capture = FindSharedCapture(view, node);
+
+      if (const int32* own_node = own_nodes.Find(node.portal))
+      {
+         if (shared_capture)
+         {
+            node.is_shared = true;
+            node.render_targets = shared_capture->render_targets;
+
+            INC_DWORD_STAT(STAT_PortalSharedCaptures);
+            continue;
+         }
+
+         if (!render_target_pool)
+         {
+            node.is_scheduled = false;
+            continue;
+         }
+
+         const int32 nb_textures = render_nodes[*own_node].render_targets.Num();
+         const FIntPoint size = UPortalSceneCapture::CalculateRenderSize(node.screen_rect, node.depth, view.viewport_size);
+         const EPortalRenderTargetFormat format = UPortalSceneCapture::GetRenderTargetFormat(node.portal, node.depth);
+
+         for (int32 texture_index = 0; texture_index < nb_textures; ++texture_index)
+         {
+            UTextureRenderTarget2D* texture = render_target_pool->LeaseRenderTarget(size.X, size.Y, format);
+
+            node.render_targets.Add(texture);
+            m_leased_render_targets.Add(texture);
+         }
+
+         INC_DWORD_STAT_BY(STAT_PortalTextureCopies, nb_textures);
+      }
+      else
+      {
+         // Makes sure the SCs have their default texture
+         node.portal->UpdateCaptureViews(node.watched_actor_transform, projection_matrix);
+
+         // Checked before resizing, a new texture would be empty
+         node.is_reused = CanReuseLastTexture(view, node);
+         node.is_shared = !node.is_reused && shared_capture != nullptr;
+
+         const bool can_resize = !node.is_reused && !node.is_shared;
+         const int32 nb_scene_captures = node.portal->GetSceneCaptures().Num();
+
+         // The textures owned by the portal follow the size of its most visible node
+         if (view.index == 0)
+         {
+            for (int32 i = 0; i < nb_scene_captures; ++i)
+            {
+               UPortalSceneCapture* scene_capture = node.portal->GetSceneCaptures()[i];
+
+               // The barely visible captures of composited portals need less resolution
+               if (can_resize)
+                  scene_capture->UpdateRenderTarget(node.screen_rect, node.depth, view.viewport_size * node.portal->GetSceneCaptureResolutionScale(i), inout_resize_budget);
+
+               node.render_targets.Add(scene_capture->GetRenderTarget());
+            }
+
+            // The SCs only own the textures of the first eye
+            if (nb_eyes > 1)
+               node.render_targets.Append(UpdateViewRenderTargets(view, node, nb_scene_captures * (nb_eyes - 1), can_resize, inout_resize_budget));
+         }
+         else
+            node.render_targets = UpdateViewRenderTargets(view, node, nb_scene_captures * nb_eyes, can_resize, inout_resize_budget);
+
+         // The textures of the other view are displayed instead, the own ones keep their last capture
+         if (node.is_shared)
+            node.render_targets = shared_capture->render_targets;
+
+         own_nodes.Add(node.portal, node_index);
+      }
+
+      if (!node.is_reused && !node.is_shared)
+         ShareSceneCaptures(view, node_index);
+
+      if (node.is_shared)
+         INC_DWORD_STAT(STAT_PortalSharedCaptures);
+
+      else if (!node.is_reused && CVarPortalShareCaptures.GetValueOnGameThread())
+      {
+         FPortalSharedCapture& new_shared_capture = m_shared_captures.Add(MakeNodeCaptureKey(view, node));
+         new_shared_capture.view_index = view.index;
+         new_shared_capture.node_index = node_index;
+         new_shared_capture.render_targets = node.render_targets;
+      }
+   }
+
+   // Children are stored after their parent, so going backward they are always captured first
+   for (int32 node_index = render_nodes.Num() - 1; node_index >= 0; --node_index)
+   {
+      const FPortalRenderNode& node = render_nodes[node_index];
+
+      if (!node.is_scheduled || node.is_reused || node.is_shared)
+         continue;
+
+      const int32 nb_scene_captures = node.portal->GetSceneCaptures().Num();
+
+      // The eyes share the node, but each is captured from its own place
+      for (int32 eye_index = 0; eye_index < nb_eyes; ++eye_index)
+      {
+         // The children have to display what has been captured for this node, or their last texture if they were skipped
+         for (int32 child_index : node.children)
+         {
+            const FPortalRenderNode& child = render_nodes[child_index];
+
+            if (child.is_scheduled && !child.is_reused)
+               child.portal->SetSceneCaptureRenderTargets(GetEyeRenderTargets(view, child, eye_index), GetViewProjectionMatrix(view, child, eye_index));
+
+            else if (const int32* own_node = own_nodes.Find(child.portal))
+               child.portal->SetSceneCaptureRenderTargets(GetEyeRenderTargets(view, render_nodes[*own_node], eye_index), GetOwnTextureViewProjectionMatrix(view, render_nodes[*own_node], eye_index, GetViewProjectionMatrix(view, child, eye_index)));
+
+            child.portal->UpdatePortalTexture();
+            child.portal->SetActive(true);
+         }
+
+         node.portal->SetSceneCaptureRenderTargets(GetEyeRenderTargets(view, node, eye_index), GetViewProjectionMatrix(view, node, eye_index));
+         node.portal->UpdateCaptureViews(node.eye_watched_actor_transforms[eye_index], GetCaptureProjectionMatrix(view, node, eye_index));
+         const TConstArrayView<bool> skipped_scene_captures = node.is_capture_shared.Num() > 0 ? MakeArrayView(node.is_capture_shared.GetData() + eye_index * nb_scene_captures, nb_scene_captures) : TConstArrayView<bool>();
+         node.portal->CaptureScenes(node.depth, skipped_scene_captures);
+      }
+
+      // Some own textures were not captured, they can't be reused as a whole
+      if (own_nodes.FindChecked(node.portal) == node_index && node.is_capture_shared.Contains(true))
+         view.portal_texture_states.Remove(node.portal);
+
+      // Remember from where the own textures were captured, to reproject them on the frames they are reused
+      else if (own_nodes.FindChecked(node.portal) == node_index)
+      {
+         FPortalTextureState& texture_state = view.portal_texture_states.FindOrAdd(node.portal);
+         texture_state.capture_frame = GFrameCounter;
+         texture_state.view_projection_matrices.Reset();
+
+         for (int32 eye_index = 0; eye_index < nb_eyes; ++eye_index)
+            texture_state.view_projection_matrices.Add(GetViewProjectionMatrix(view, node, eye_index));
+      }
+   }
+
+   // What the player sees directly are the textures owned by the portals, on the mesh of the view
+   for (auto& own_node : own_nodes)
+   {
+      APortal* portal = own_node.Key;
+      const FPortalRenderNode& node = render_nodes[own_node.Value];
+
+      portal->SetSceneCaptureRenderTargets(GetEyeRenderTargets(view, node, 0), GetOwnTextureViewProjectionMatrix(view, node, 0, FMatrix::Identity));
+
+      if (nb_eyes > 1)
+         portal->SetRightEyeRenderTargets(GetEyeRenderTargets(view, node, 1), GetOwnTextureViewProjectionMatrix(view, node, 1, FMatrix::Identity));
+
+      portal->UpdatePortalTexture(view.index);
+      portal->SetActive(true);
+   }
+}
+
+
+TArray<UTextureRenderTarget2D*>& APortalManager::UpdateViewRenderTargets(FPortalView& view, const FPortalRenderNode& node, int32 nb_textures, bool can_resize, int32& inout_resize_budget) const
+{
+   TArray<UTextureRenderTarget2D*>& render_targets = view.portal_render_targets.FindOrAdd(node.portal);
+
+   UPortalRenderTargetPool* render_target_pool = GetWorld()->GetSubsystem<UPortalRenderTargetPool>();
+   if (!render_target_pool)
+      return render_targets;
+
+   const EPortalRenderTargetFormat format = UPortalSceneCapture::GetRenderTargetFormat(node.portal, node.depth);
+
+   // Missing textures are always created, there would be nothing to display otherwise
+   bool needs_new_render_targets = render_targets.Num() != nb_textures;
+
+   if (!needs_new_render_targets && can_resize && inout_resize_budget > 0)
+   {
+      for (const UTextureRenderTarget2D* render_target : render_targets)
+         needs_new_render_targets |= UPortalSceneCapture::NeedsNewRenderTarget(render_target, node.screen_rect, node.depth, view.viewport_size, format);
+
+      if (needs_new_render_targets)
+         --inout_resize_budget;
+   }
+
+   if (!needs_new_render_targets)
+      return render_targets;
+
+   // The node is captured right after, so unlike the SceneCapture textures the new ones can be used at once
+   for (UTextureRenderTarget2D* render_target : render_targets)
+      render_target_pool->ReleaseRenderTarget(render_target);
+
+   render_targets.Reset();
+
+   const FIntPoint size = UPortalSceneCapture::CalculateRenderSize(node.screen_rect, node.depth, view.viewport_size);
+
+   for (int32 texture_index = 0; texture_index < nb_textures; ++texture_index)
+      render_targets.Add(render_target_pool->LeaseRenderTarget(size.X, size.Y, format));
+
+   return render_targets;
+}
+
+
+const FPortalSharedCapture* APortalManager::FindSharedCapture(const FPortalView& view, const FPortalRenderNode& node) const
+{
+   if (!CVarPortalShareCaptures.GetValueOnGameThread())
+      return nullptr;
+
+   const FPortalSharedCapture* shared_capture = m_shared_captures.Find(MakeNodeCaptureKey(view, node));
+
+   return (shared_capture && CanDisplaySharedCapture(view, node, *shared_capture)) ? shared_capture : nullptr;
+}
+
+
+void APortalManager::ShareSceneCaptures(FPortalView& view, int32 node_index)
+{
+   FPortalRenderNode& node = view.render_nodes[node_index];
+
+   const int32 nb_eyes = view.eye_transforms.Num();
+   const TArray<UPortalSceneCapture*>& scene_captures = node.portal->GetSceneCaptures();
+
+   if (!CVarPortalShareCaptures.GetValueOnGameThread() || scene_captures.Num() == 0 || node.render_targets.Num() != scene_captures.Num() * nb_eyes)
+      return;
+
+   node.is_capture_shared.Init(false, node.render_targets.Num());
+
+   int32 nb_shared = 0;
+
+   for (int32 eye_index = 0; eye_index < nb_eyes; ++eye_index)
+   {
+      // The SCs are placed as they will be when captured
+      node.portal->UpdateCaptureViews(node.eye_watched_actor_transforms[eye_index], GetCaptureProjectionMatrix(view, node, eye_index));
+
+      for (int32 scene_capture_index = 0; scene_capture_index < scene_captures.Num(); ++scene_capture_index)
+      {
+         const UPortalSceneCapture* scene_capture = scene_captures[scene_capture_index];
+         if (!scene_capture->GetLinkedPortal())
+            continue;
+
+         // What a SC sees only depends on where it is and the portal it looks through, not on the portal it belongs to
+         const FPortalCaptureKey key = MakeCaptureKey(scene_capture->GetLinkedPortal(), scene_capture->GetComponentTransform(), scene_capture->CustomProjectionMatrix, node.depth, int32(scene_capture->getType()));
+         const int32 texture_index = eye_index * scene_captures.Num() + scene_capture_index;
+
+         const FPortalSharedCapture* shared_capture = m_shared_scene_captures.Find(key);
+
+         if (shared_capture && CanDisplaySharedCapture(view, node, *shared_capture))
+         {
+            node.render_targets[texture_index] = shared_capture->render_targets[0];
+            node.is_capture_shared[texture_index] = true;
+            nb_shared++;
+
+            INC_DWORD_STAT(STAT_PortalSharedCaptures);
+         }
+         else
+         {
+            FPortalSharedCapture& new_shared_capture = m_shared_scene_captures.Add(key);
+            new_shared_capture.view_index = view.index;
+            new_shared_capture.node_index = node_index;
+            new_shared_capture.render_targets.Add(node.render_targets[texture_index]);
+         }
+      }
+   }
+
+   // Nothing is left to capture, so neither is what is seen through the node
+   if (nb_shared == node.render_targets.Num())
+      node.is_shared = true;
+}
+
+
+bool APortalManager::CanDisplaySharedCapture(const FPortalView& view, const FPortalRenderNode& node, const FPortalSharedCapture& shared_capture)
+{
+   // The other views are rendered first, and the directly visible portals are displayed once every capture is done
+   if (shared_capture.view_index != view.index || node.parent == INDEX_NONE)
+      return true;
+
+   // Going backward, the nodes after the parent are captured before it
+   return shared_capture.node_index > node.parent;
+}
+
+
+FPortalCaptureKey APortalManager::MakeCaptureKey(const UObject* portal, const FTransform& transform, const FMatrix& projection_matrix, unsigned int depth, int32 variant)
+{
+   const double distance_step = FMath::Max(CVarPortalShareCapturesDistance.GetValueOnGameThread(), UE_KINDA_SMALL_NUMBER);
+   const double angle_step = FMath::Max(CVarPortalShareCapturesAngle.GetValueOnGameThread(), UE_KINDA_SMALL_NUMBER);
+
+   const FVector location = transform.GetLocation() / distance_step;
+   const FRotator rotation = transform.Rotator();
+
+   FPortalCaptureKey key;
+   key.portal = portal;
+   key.location = FIntVector(FMath::RoundToInt(location.X), FMath::RoundToInt(location.Y), FMath::RoundToInt(location.Z));
+   key.rotation = FIntVector(FMath::RoundToInt(rotation.Pitch / angle_step), FMath::RoundToInt(rotation.Yaw / angle_step), FMath::RoundToInt(rotation.Roll / angle_step));
+   key.depth = depth;
+   key.variant = variant;
+
+   // The projections are equal or differ by more than the rounding, e.g. when the captures are cropped to other parts of the screen
+   for (int32 row = 0; row < 4; ++row)
+   {
+      for (int32 column = 0; column < 4; ++column)
+         key.projection_hash = HashCombine(key.projection_hash, GetTypeHash(FMath::RoundToInt64(projection_matrix.M[row][column] * 1024.)));
+   }
+
+   return key;
+}
+
+
+FPortalCaptureKey APortalManager::MakeNodeCaptureKey(const FPortalView& view, const FPortalRenderNode& node)
+{
+   // The capture rects of the eyes follow the first one, as do their transforms
+   return MakeCaptureKey(node.portal, node.watched_actor_transform, GetCaptureProjectionMatrix(view, node, 0), node.depth, view.eye_transforms.Num());
+}
+
+
+TArray<UTextureRenderTarget2D*> APortalManager::GetEyeRenderTargets(const FPortalView& view, const FPortalRenderNode& node, int32 eye_index)
+{
+   const int32 nb_textures = node.render_targets.Num() / FMath::Max(view.eye_transforms.Num(), 1);
+
+   return TArray<UTextureRenderTarget2D*>(node.render_targets.GetData() + eye_index * nb_textures, nb_textures);
+}
+
+
+bool APortalManager::CanReuseLastTexture(const FPortalView& view, const FPortalRenderNode& node)
+{
+   if (!CVarPortalTemporalReuse.GetValueOnGameThread())
+      return false;
+
+   // Nothing was ever captured for the portal
+   const FPortalTextureState* texture_state = view.portal_texture_states.Find(node.portal);
+   if (!texture_state)
+      return false;
+
+   return GFrameCounter - texture_state->capture_frame < uint64(GetCaptureInterval(node));
+}
+
+
+int32 APortalManager::GetCaptureInterval(const FPortalRenderNode& node)
+{
+   const bool is_small = node.coverage < CVarPortalTemporalReuseMinCoverage.GetValueOnGameThread();
+
+   // The portals the player looks at are always captured at full rate
+   if (node.depth == 0 && !is_small)
+      return 1;
+
+   const int32 interval = 1 + node.depth * CVarPortalTemporalReuseFramesPerDepth.GetValueOnGameThread() + (is_small ? 1 : 0);
+
+   return FMath::Clamp(interval, 1, FMath::Max(CVarPortalTemporalReuseMaxInterval.GetValueOnGameThread(), 1));
+}
+
+
+FMatrix APortalManager::GetCaptureProjectionMatrix(const FPortalView& view, const FPortalRenderNode& node, int32 eye_index)
+{
+   return view.eye_projection_matrices[eye_index] * Tools::ComputeCropMatrix(node.eye_capture_rects[eye_index]);
+}
+
+
+FMatrix APortalManager::GetViewProjectionMatrix(const FPortalView& view, const FPortalRenderNode& node, int32 eye_index)
+{
+   return Tools::ComputeViewMatrix(node.eye_watched_actor_transforms[eye_index]) * GetCaptureProjectionMatrix(view, node, eye_index);
+}
+
+
+FMatrix APortalManager::GetTextureViewProjectionMatrix(const FPortalView& view, const APortal* portal, int32 eye_index, const FMatrix& default_matrix)
+{
+   const FPortalTextureState* texture_state = view.portal_texture_states.Find(portal);
+
+   if (!texture_state || !texture_state->view_projection_matrices.IsValidIndex(eye_index))
+      return default_matrix;
+
+   return texture_state->view_projection_matrices[eye_index];
+}
+
+
+FMatrix APortalManager::GetOwnTextureViewProjectionMatrix(const FPortalView& view, const FPortalRenderNode& own_node, int32 eye_index, const FMatrix& default_matrix)
+{
+   // Shared textures were captured this frame, from the same place as the node
+   if (own_node.is_shared)
+      return GetViewProjectionMatrix(view, own_node, eye_index);
+
+   return GetTextureViewProjectionMatrix(view, own_node.portal, eye_index, default_matrix);
+}
+
+
+float APortalManager::EstimateCaptureCost(const APortal* portal)
+{
+   float nb_pixels = 0.f;
+
+   const TArray<UPortalSceneCapture*>& scene_captures = portal->GetSceneCaptures();
+
+   for (int32 i = 0; i < scene_captures.Num(); ++i)
+   {
+      if (portal->IsSceneCaptureSkipped(i))
+         continue;
+
+      if (const UTextureRenderTarget2D* render_target = scene_captures[i]->GetRenderTarget())
+         nb_pixels += float(render_target->SizeX) * float(render_target->SizeY);
+   }
+
+   return nb_pixels / 1000000.f * CVarPortalCaptureCostPerMegapixel.GetValueOnGameThread();
+}
+
+
+void APortalManager::ComputeVisiblePortals(const TArray<APortal*>& candidates, USceneComponent* camera, uint32 path_hash, float near_plane_distance, TArray<APortal*>& OUT_visible_portals)
+{
+   SCOPE_CYCLE_COUNTER(STAT_PortalVisibilityTest);
+   TRACE_CPUPROFILER_EVENT_SCOPE(APortalManager::ComputeVisiblePortals);
+
+   OUT_visible_portals.Reset();
+
+   FConvexVolume frustum;
+   if (candidates.Num() == 0 || !Tools::ComputeCameraFrustum(camera, near_plane_distance, frustum))
+      return;
+
+   const int32 nb_candidates = candidates.Num();
+   FPortalVisibilityBatch& batch = m_visibility_batch;
+
+   batch.locations.SetNumUninitialized(nb_candidates, false);
+   batch.normals.SetNumUninitialized(nb_candidates, false);
+   batch.bounds_origins.SetNumUninitialized(nb_candidates, false);
+   batch.bounds_extents.SetNumUninitialized(nb_candidates, false);
+   batch.is_in_view.SetNumUninitialized(nb_candidates, false);
+
+   // Reading the actors is not thread safe, they are flattened on the game thread
+   for (int32 index = 0; index < nb_candidates; ++index)
+   {
+      const APortal* candidate = candidates[index];
+
+      batch.locations[index] = candidate->GetActorLocation();
+      batch.normals[index] = candidate->GetActorForwardVector();
+      candidate->GetActorBounds(true, batch.bounds_origins[index], batch.bounds_extents[index], false);
+   }
+
+   const FVector camera_location = camera->GetComponentLocation();
+   const double max_distance_squared = FMath::Square(double(GetActivePortalDistance()));
+
+   // Same tests as Tools::isPortalInCameraView
+   auto test_frustum = [&batch, &frustum, &camera_location, max_distance_squared](int32 index)
+   {
+      const FVector portal_to_camera = camera_location - batch.locations[index];
+
+      const bool is_in_view = portal_to_camera.SizeSquared() <= max_distance_squared
+                              && FVector::DotProduct(batch.normals[index], portal_to_camera) > 0
+                              && frustum.IntersectBox(batch.bounds_origins[index], batch.bounds_extents[index]);
+
+      batch.is_in_view[index] = is_in_view ? 1 : 0;
+   };
+
+   const bool is_single_thread = !CVarPortalParallelVisibility.GetValueOnGameThread() || nb_candidates < CVarPortalParallelVisibilityMinPortals.GetValueOnGameThread();
+   ParallelFor(nb_candidates, test_frustum, is_single_thread);
+
+   // The traces read the physics scene and the asynchronous ones write the cache, both stay on the game thread
+   const bool is_async = CVarPortalAsyncVisibilityTraces.GetValueOnGameThread() != 0;
+
+   for (int32 index = 0; index < nb_candidates; ++index)
+   {
+      if (!batch.is_in_view[index])
+         continue;
+
+      APortal* candidate = candidates[index];
+      const bool is_visible = is_async ? m_async_visibility.IsPortalVisible(candidate, camera, path_hash) : !Tools::isPortalOccluded(candidate, camera);
+
+      if (is_visible)
+         OUT_visible_portals.Add(candidate);
+   }
+}
+
+
+const TArray<APortal*>& APortalManager::GetVisibilityCandidates(const UPortalSceneCapture* scene_capture) const
+{
+   static const TArray<APortal*> no_candidates;
+
+   const TArray<APortal*>* candidates = m_visibility_candidates.Find(scene_capture);
+
+   return candidates ? *candidates : no_candidates;
+}
+
+
+void APortalManager::RebuildVisibilityGraph()
+{
+   m_portals.RemoveAll([](const APortal* portal) { return !IsValid(portal); });
+
+   m_portal_grid.Reset();
+   m_portal_cells.Reset();
+   m_visibility_candidates.Reset();
+   m_moved_portals.Reset();
+
+   // A cell as wide as the active distance keeps range queries to a few cells
+   m_grid_cell_size = FMath::Max(1.f, float(APortal::GetActivePortalDistance()));
+
+   for (APortal* portal : m_portals)
+   {
+      const FIntVector cell = GetGridCell(portal->GetActorLocation());
+
+      m_portal_grid.FindOrAdd(cell).Add(portal);
+      m_portal_cells.Add(portal, cell);
+   }
+
+   for (APortal* portal : m_portals)
+   {
+      for (UPortalSceneCapture* scene_capture : portal->GetSceneCaptures())
+      {
+         TArray<APortal*>& candidates = m_visibility_candidates.Add(scene_capture);
+         ComputeVisibilityCandidates(scene_capture, candidates);
+      }
+   }
+
+   m_is_visibility_graph_dirty = false;
+}
+
+
+void APortalManager::UpdateMovedPortals()
+{
+   for (APortal* portal : m_moved_portals)
+   {
+      if (!m_portal_cells.Contains(portal))
+         continue;
+
+      const FIntVector new_cell = GetGridCell(portal->GetActorLocation());
+      FIntVector& cell = m_portal_cells[portal];
+
+      if (new_cell != cell)
+      {
+         if (TArray<APortal*>* old_cell_portals = m_portal_grid.Find(cell))
+            old_cell_portals->Remove(portal);
+
+         m_portal_grid.FindOrAdd(new_cell).Add(portal);
+         cell = new_cell;
+      }
+   }
+
+   for (auto& visibility_candidates : m_visibility_candidates)
+   {
+      const UPortalSceneCapture* scene_capture = visibility_candidates.Key;
+      TArray<APortal*>& candidates = visibility_candidates.Value;
+
+      // What the SC can see depends on where its owner and its linked portal are
+      if (m_moved_portals.Contains(Cast<APortal>(scene_capture->GetOwner())) || m_moved_portals.Contains(scene_capture->GetLinkedPortal()))
+      {
+         candidates.Reset();
+         ComputeVisibilityCandidates(scene_capture, candidates);
+         continue;
+      }
+
+      // Otherwise only the moved portals have to be tested again
+      for (APortal* portal : m_moved_portals)
+      {
+         candidates.Remove(portal);
+
+         if (IsVisibilityCandidate(scene_capture, portal))
+            candidates.Add(portal);
+      }
+   }
+
+   m_moved_portals.Reset();
+}
+
+
+void APortalManager::ComputeVisibilityCandidates(const UPortalSceneCapture* scene_capture, TArray<APortal*>& out_candidates) const
+{
+   const APortal* owner = Cast<APortal>(scene_capture->GetOwner());
+   const APortal* linked_portal = scene_capture->GetLinkedPortal();
+
+   if (!owner)
+      return;
+
+   // The SceneCapture looks at the world from its linked portal, or from its owner for holes and mirrors
+   const bool is_portal = scene_capture->GetTrueType() == ECameraType::Portal;
+   const APortal* target_portal = (is_portal && linked_portal) ? linked_portal : owner;
+
+   TArray<APortal*> portals_in_range;
+   GatherPortalsInRange(target_portal->GetActorLocation(), 2.f * APortal::GetActivePortalDistance(), portals_in_range);
+
+   for (APortal* portal : portals_in_range)
+   {
+      if (IsVisibilityCandidate(scene_capture, portal))
+         out_candidates.Add(portal);
+   }
+}
+
+
+bool APortalManager::IsVisibilityCandidate(const UPortalSceneCapture* scene_capture, const APortal* portal) const
+{
+   const APortal* owner = Cast<APortal>(scene_capture->GetOwner());
+   const APortal* linked_portal = scene_capture->GetLinkedPortal();
+
+   // The linked portal is never rendered through its own SceneCapture
+   if (!owner || portal == linked_portal)
+      return false;
+
+   // The SceneCapture looks at the world from its linked portal, or from its owner for holes and mirrors
+   const bool is_portal = scene_capture->GetTrueType() == ECameraType::Portal;
+   const APortal* target_portal = (is_portal && linked_portal) ? linked_portal : owner;
+
+   // The watched actor is less than the active distance away from the owner, so is the SceneCapture from the target, 
+   // and a visible portal must be less than the active distance away from the SceneCapture
+   const float range = 2.f * APortal::GetActivePortalDistance();
+
+   if (FVector::DistSquared(portal->GetActorLocation(), target_portal->GetActorLocation()) > range * range)
+      return false;
+
+   // Same side as the one kept by the clip plane (see UpdateNearClipPlane)
+   // With refraction, total reflection can turn the SceneCapture into a mirror so both sides can be seen
+   const bool is_mirror = scene_capture->GetTrueType() == ECameraType::Mirror;
+
+   if (!is_mirror && scene_capture->HasRefraction())
+      return true;
+
+   const FVector visible_side = - target_portal->GetActorForwardVector() * ((is_mirror || scene_capture->IsExitInFront()) ? -1 : 1);
+
+   FVector portal_origin, portal_extent;
+   portal->GetActorBounds(true, portal_origin, portal_extent, false);
+
+   const float projected_extent = FVector::DotProduct(portal_extent, visible_side.GetAbs());
+
+   return FVector::DotProduct(portal_origin - target_portal->GetActorLocation(), visible_side) + projected_extent >= 0.f;
+}
+
+
+void APortalManager::GatherPortalsInRange(const FVector& location, float range, TArray<APortal*>& out_portals) const
+{
+   const FIntVector min_cell = GetGridCell(location - FVector(range));
+   const FIntVector max_cell = GetGridCell(location + FVector(range));
+   const float range_squared = range * range;
+
+   for (int32 x = min_cell.X; x <= max_cell.X; ++x)
+   {
+      for (int32 y = min_cell.Y; y <= max_cell.Y; ++y)
+      {
+         for (int32 z = min_cell.Z; z <= max_cell.Z; ++z)
+         {
+            const TArray<APortal*>* cell = m_portal_grid.Find(FIntVector(x, y, z));
+
+            if (!cell)
+               continue;
+
+            for (APortal* portal : *cell)
+            {
+               if (FVector::DistSquared(portal->GetActorLocation(), location) <= range_squared)
+                  out_portals.Add(portal);
+            }
+         }
+      }
+   }
+}
+
+
+FIntVector APortalManager::GetGridCell(const FVector& location) const
+{
+   return FIntVector(FMath::FloorToInt(location.X / m_grid_cell_size),
+                     FMath::FloorToInt(location.Y / m_grid_cell_size),
+                     FMath::FloorToInt(location.Z / m_grid_cell_size));
 }
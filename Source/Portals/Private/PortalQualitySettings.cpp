@@ -0,0 +1,53 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#include "PortalQualitySettings.h"
+
+#include <HAL/IConsoleManager.h>
+
+
+UPortalQualitySettings::UPortalQualitySettings()
+{
+   // Low, Medium, High, Epic. Epic matches the former capture settings
+   FPortalCaptureQualityTier& low = m_tiers.AddDefaulted_GetRef();
+   low.ambient_occlusion_quality = 0.f;
+   low.screen_space_reflection_quality = 0.f;
+   low.dynamic_shadows = false;
+   low.particles = false;
+   low.fog = false;
+   low.lod_distance_factor = 5.f;
+   low.max_render_depth = 1;
+
+   FPortalCaptureQualityTier& medium = m_tiers.AddDefaulted_GetRef();
+   medium.ambient_occlusion_quality = 25.f;
+   medium.screen_space_reflection_quality = 0.f;
+   medium.particles = false;
+   medium.lod_distance_factor = 4.f;
+   medium.max_render_depth = 2;
+
+   FPortalCaptureQualityTier& high = m_tiers.AddDefaulted_GetRef();
+   high.ambient_occlusion_quality = 50.f;
+   high.screen_space_reflection_quality = 25.f;
+   high.lod_distance_factor = 3.f;
+   high.max_render_depth = 3;
+
+   m_tiers.AddDefaulted();
+}
+
+
+const FPortalCaptureQualityTier& UPortalQualitySettings::GetTier(unsigned int depth) const
+{
+   static const FPortalCaptureQualityTier default_tier;
+
+   return m_tiers.Num() > 0 ? m_tiers[GetTierIndex(depth)] : default_tier;
+}
+
+
+int32 UPortalQualitySettings::GetTierIndex(unsigned int depth) const
+{
+   int32 tier_index = m_tiers.Num() - 1;
+
+   if (IConsoleVariable* scalability_group = IConsoleManager::Get().FindConsoleVariable(*m_scalability_group))
+      tier_index = FMath::Clamp(scalability_group->GetInt(), 0, m_tiers.Num() - 1);
+
+   return FMath::Max(tier_index - int32(depth) * m_tiers_dropped_per_depth, 0);
+}
@@ -0,0 +1,260 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#include "PortalRenderTargetPool.h"
+
+#include <HAL/IConsoleManager.h>
+
+#include "PortalStats.h"
+
+
+static TAutoConsoleVariable<int32> CVarPortalPoolMaxIdleFrames(
+   TEXT("r.Portals.Pool.MaxIdleFrames"),
+   300,
+   TEXT("Number of frames a free render target stays in the pool without being leased before it is freed. Negative to keep them."),
+   ECVF_Default);
+
+static TAutoConsoleVariable<float> CVarPortalPoolMaxFreeMemory(
+   TEXT("r.Portals.Pool.MaxFreeMemory"),
+   64.f,
+   TEXT("Memory in MB the free render targets of the pool can take, the oldest ones are freed past it. Negative for no limit."),
+   ECVF_Default);
+
+
+UTextureRenderTarget2D* UPortalRenderTargetPool::LeaseRenderTarget(int32 size_x, int32 size_y, EPortalRenderTargetFormat format)
+{
+   if (format == EPortalRenderTargetFormat::Default)
+      format = EPortalRenderTargetFormat::RGBA16f;
+
+   size_x = FMath::Max(size_x, 1);
+   size_y = FMath::Max(size_y, 1);
+
+   UTextureRenderTarget2D* render_target = nullptr;
+
+   FPortalRenderTargetBucket* bucket = m_free_render_targets.Find(GetBucketKey(size_x, size_y, format));
+
+   // Reuse a free render target if possible
+   while (bucket && bucket->render_targets.Num() > 0 && !render_target)
+   {
+      render_target = bucket->render_targets.Pop(false);
+      bucket->release_frames.Pop(false);
+
+      if (!IsValid(render_target))
+         render_target = nullptr;
+   }
+
+   if (!render_target)
+      render_target = CreateRenderTarget(size_x, size_y, format);
+   else
+   {
+      const int64 memory = GetMemory(render_target);
+
+      m_free_render_target_memory -= memory;
+      DEC_MEMORY_STAT_BY(STAT_PortalFreeRenderTargetMemory, memory);
+   }
+
+   m_leased_render_targets.Add(render_target);
+   INC_MEMORY_STAT_BY(STAT_PortalRenderTargetMemory, GetMemory(render_target));
+
+   return render_target;
+}
+
+
+void UPortalRenderTargetPool::ReleaseRenderTarget(UTextureRenderTarget2D* render_target)
+{
+   // Only take back what has been leased, to avoid sharing a render target twice
+   if (!render_target || m_leased_render_targets.Remove(render_target) == 0)
+      return;
+
+   const FIntVector key = GetBucketKey(render_target->SizeX, render_target->SizeY, GetFormat(render_target));
+
+   FPortalRenderTargetBucket& bucket = m_free_render_targets.FindOrAdd(key);
+   bucket.render_targets.Add(render_target);
+   bucket.release_frames.Add(GFrameCounter);
+
+   // Counted as free until leased again, resized render targets thus leave the leased memory
+   const int64 memory = GetMemory(render_target);
+
+   m_free_render_target_memory += memory;
+   DEC_MEMORY_STAT_BY(STAT_PortalRenderTargetMemory, memory);
+   INC_MEMORY_STAT_BY(STAT_PortalFreeRenderTargetMemory, memory);
+}
+
+
+void UPortalRenderTargetPool::TrimFreeRenderTargets()
+{
+   const int32 max_idle_frames = CVarPortalPoolMaxIdleFrames.GetValueOnGameThread();
+   const float max_free_memory_mb = CVarPortalPoolMaxFreeMemory.GetValueOnGameThread();
+
+   // The release frames of a bucket are increasing, its idle render targets are the first ones
+   if (max_idle_frames >= 0)
+   {
+      for (auto& free_bucket : m_free_render_targets)
+      {
+         FPortalRenderTargetBucket& bucket = free_bucket.Value;
+
+         int32 nb_idle = 0;
+         while (nb_idle < bucket.release_frames.Num() && bucket.release_frames[nb_idle] + max_idle_frames < GFrameCounter)
+            FreeRenderTarget(bucket.render_targets[nb_idle++]);
+
+         bucket.render_targets.RemoveAt(0, nb_idle, false);
+         bucket.release_frames.RemoveAt(0, nb_idle, false);
+      }
+   }
+
+   if (max_free_memory_mb >= 0.f)
+   {
+      const int64 max_free_memory = int64(max_free_memory_mb * 1024.f * 1024.f);
+
+      while (m_free_render_target_memory > max_free_memory)
+      {
+         // The render target released the longest ago is the first one of one of the buckets
+         // The ones released this frame may still be displayed by the portals until their next update, they are kept
+         FPortalRenderTargetBucket* oldest_bucket = nullptr;
+
+         for (auto& free_bucket : m_free_render_targets)
+         {
+            FPortalRenderTargetBucket& bucket = free_bucket.Value;
+
+            if (bucket.release_frames.Num() > 0 && bucket.release_frames[0] < GFrameCounter && (!oldest_bucket || bucket.release_frames[0] < oldest_bucket->release_frames[0]))
+               oldest_bucket = &bucket;
+         }
+
+         if (!oldest_bucket)
+            break;
+
+         FreeRenderTarget(oldest_bucket->render_targets[0]);
+         oldest_bucket->render_targets.RemoveAt(0, 1, false);
+         oldest_bucket->release_frames.RemoveAt(0, 1, false);
+      }
+   }
+
+   for (auto it = m_free_render_targets.CreateIterator(); it; ++it)
+   {
+      if (it.Value().render_targets.Num() == 0)
+         it.RemoveCurrent();
+   }
+}
+
+
+void UPortalRenderTargetPool::Deinitialize()
+{
+   for (auto& free_bucket : m_free_render_targets)
+   {
+      for (UTextureRenderTarget2D* render_target : free_bucket.Value.render_targets)
+      {
+         if (IsValid(render_target))
+            render_target->ReleaseResource();
+      }
+   }
+
+   m_free_render_targets.Empty();
+   m_leased_render_targets.Empty();
+
+   DEC_MEMORY_STAT_BY(STAT_PortalRenderTargetMemory, m_render_target_memory - m_free_render_target_memory);
+   DEC_MEMORY_STAT_BY(STAT_PortalFreeRenderTargetMemory, m_free_render_target_memory);
+   m_render_target_memory = 0;
+   m_free_render_target_memory = 0;
+
+   Super::Deinitialize();
+}
+
+
+bool UPortalRenderTargetPool::DoesSupportWorldType(EWorldType::Type world_type) const
+{
+   return world_type == EWorldType::Game || world_type == EWorldType::PIE;
+}
+
+
+EPortalRenderTargetFormat UPortalRenderTargetPool::GetFormat(const UTextureRenderTarget2D* render_target)
+{
+   if (render_target->OverrideFormat == PF_FloatR11G11B10)
+      return EPortalRenderTargetFormat::R11G11B10f;
+
+   switch (render_target->RenderTargetFormat)
+   {
+   case ETextureRenderTargetFormat::RTF_RGB10A2:
+      return EPortalRenderTargetFormat::RGB10A2;
+
+   case ETextureRenderTargetFormat::RTF_RGBA8:
+      return EPortalRenderTargetFormat::RGBA8;
+
+   default:
+      return EPortalRenderTargetFormat::RGBA16f;
+   }
+}
+
+
+FIntVector UPortalRenderTargetPool::GetBucketKey(int32 size_x, int32 size_y, EPortalRenderTargetFormat format)
+{
+   return FIntVector(size_x, size_y, int32(format));
+}
+
+
+UTextureRenderTarget2D* UPortalRenderTargetPool::CreateRenderTarget(int32 size_x, int32 size_y, EPortalRenderTargetFormat format)
+{
+   UTextureRenderTarget2D* render_target = NewObject<UTextureRenderTarget2D>(this);
+
+   switch (format)
+   {
+   // Not part of ETextureRenderTargetFormat, the pixel format is forced instead
+   case EPortalRenderTargetFormat::R11G11B10f:
+      render_target->RenderTargetFormat = ETextureRenderTargetFormat::RTF_RGBA16f;
+      render_target->OverrideFormat = PF_FloatR11G11B10;
+      break;
+
+   case EPortalRenderTargetFormat::RGB10A2:
+      render_target->RenderTargetFormat = ETextureRenderTargetFormat::RTF_RGB10A2;
+      break;
+
+   case EPortalRenderTargetFormat::RGBA8:
+      render_target->RenderTargetFormat = ETextureRenderTargetFormat::RTF_RGBA8;
+      break;
+
+   default:
+      render_target->RenderTargetFormat = ETextureRenderTargetFormat::RTF_RGBA16f;
+      break;
+   }
+
+   render_target->Filter = TextureFilter::TF_Bilinear;
+   render_target->SizeX = size_x;
+   render_target->SizeY = size_y;
+   render_target->ClearColor = FLinearColor::Blue;
+   render_target->TargetGamma = 2.2f;
+   render_target->bNeedsTwoCopies = false;
+   render_target->AddressX = TextureAddress::TA_Clamp;
+   render_target->AddressY = TextureAddress::TA_Clamp;
+
+   // Not needed since the texture is displayed on screen directly
+   // in some engine versions this can even lead to crashes (notably 4.24/4.25)
+   render_target->bAutoGenerateMips = false;
+
+   // This force the engine to create the render target 
+   // with the parameters we defined just above
+   render_target->UpdateResource();
+
+   m_render_target_memory += GetMemory(render_target);
+
+   return render_target;
+}
+
+
+int64 UPortalRenderTargetPool::GetMemory(const UTextureRenderTarget2D* render_target)
+{
+   return render_target->CalcTextureMemorySizeEnum(TMC_ResidentMips);
+}
+
+
+void UPortalRenderTargetPool::FreeRenderTarget(UTextureRenderTarget2D* render_target)
+{
+   if (!IsValid(render_target))
+      return;
+
+   const int64 memory = GetMemory(render_target);
+
+   m_render_target_memory -= memory;
+   m_free_render_target_memory -= memory;
+   DEC_MEMORY_STAT_BY(STAT_PortalFreeRenderTargetMemory, memory);
+
+   // Not referenced by anything else once out of the buckets
+   render_target->ReleaseResource();
+}
@@ -0,0 +1,102 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#include "PortalRoomVolume.h"
+
+#include <Components/BrushComponent.h>
+#include <Engine/World.h>
+#include <EngineUtils.h>
+
+#include "PortalGameModeBase.h"
+#include "PortalManager.h"
+
+
+APortalRoomVolume::APortalRoomVolume(const FObjectInitializer& ObjectInitializer) :
+   Super(ObjectInitializer)
+{
+   // Only used to know what enters and leaves the room, nothing collides with it
+   GetBrushComponent()->SetCollisionProfileName(TEXT("OverlapAllDynamic"));
+   GetBrushComponent()->SetGenerateOverlapEvents(true);
+}
+
+
+void APortalRoomVolume::BeginPlay()
+{
+   Super::BeginPlay();
+
+   GatherActors();
+
+   OnActorBeginOverlap.AddDynamic(this, &APortalRoomVolume::OnActorEntered);
+   OnActorEndOverlap.AddDynamic(this, &APortalRoomVolume::OnActorLeft);
+
+   APortalGameModeBase* game_mode = GetWorld()->GetAuthGameMode<APortalGameModeBase>();
+
+   if (game_mode && game_mode->GetPortalManager())
+      game_mode->GetPortalManager()->RegisterRoom(this);
+}
+
+
+void APortalRoomVolume::EndPlay(const EEndPlayReason::Type EndPlayReason)
+{
+   APortalGameModeBase* game_mode = GetWorld()->GetAuthGameMode<APortalGameModeBase>();
+
+   if (game_mode && IsValid(game_mode->GetPortalManager()))
+      game_mode->GetPortalManager()->UnregisterRoom(this);
+
+   Super::EndPlay(EndPlayReason);
+}
+
+
+void APortalRoomVolume::GetVisibleActors(TArray<AActor*>& OUT_actors) const
+{
+   for (AActor* actor : m_actors)
+   {
+      if (IsValid(actor))
+         OUT_actors.AddUnique(actor);
+   }
+
+   for (AActor* actor : m_extra_actors)
+   {
+      if (IsValid(actor))
+         OUT_actors.AddUnique(actor);
+   }
+}
+
+
+void APortalRoomVolume::GatherActors()
+{
+   m_actors.Reset();
+
+   const FBox room_bounds = GetComponentsBoundingBox(true);
+
+   for (TActorIterator<AActor> actors_it(GetWorld()); actors_it; ++actors_it)
+   {
+      AActor* actor = *actors_it;
+
+      if (actor == this || actor->IsA<AVolume>())
+         continue;
+
+      const FBox actor_bounds = actor->GetComponentsBoundingBox(true);
+
+      if (actor_bounds.IsValid && room_bounds.Intersect(actor_bounds))
+         m_actors.Add(actor);
+   }
+
+   ++m_revision;
+}
+
+
+void APortalRoomVolume::OnActorEntered(AActor* overlapped_actor, AActor* other_actor)
+{
+   if (other_actor && !m_actors.Contains(other_actor))
+   {
+      m_actors.Add(other_actor);
+      ++m_revision;
+   }
+}
+
+
+void APortalRoomVolume::OnActorLeft(AActor* overlapped_actor, AActor* other_actor)
+{
+   if (m_actors.Remove(other_actor) > 0)
+      ++m_revision;
+}
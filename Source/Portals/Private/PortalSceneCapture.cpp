@@ -9,15 +9,92 @@
 #include "GameFramework/PlayerCameraManager.h"
 #include "Engine/GameViewportClient.h"
 #include "Engine/Engine.h"
+#include "HAL/IConsoleManager.h"
 #include "Portal.h"
+#include "PortalManager.h"
+#include "PortalQualitySettings.h"
+#include "PortalRenderTargetPool.h"
+#include "PortalRoomVolume.h"
+#include "PortalStats.h"
 #include "PortalTools.h"
 
 
+static TAutoConsoleVariable<float> CVarPortalRenderTargetFullResolutionExtent(
+   TEXT("r.Portals.RenderTarget.FullResolutionExtent"),
+   0.5f,
+   TEXT("Fraction of the screen width (or height) a portal has to span to get a render target as wide (or high) as the screen. Only used with r.Portals.OffAxisProjection."),
+   ECVF_Scalability);
+
+static TAutoConsoleVariable<float> CVarPortalRenderTargetDepthScale(
+   TEXT("r.Portals.RenderTarget.DepthScale"),
+   0.7f,
+   TEXT("Resolution factor of the portal render targets applied for every recursion level."),
+   ECVF_Scalability);
+
+static TAutoConsoleVariable<int32> CVarPortalRenderTargetMinSize(
+   TEXT("r.Portals.RenderTarget.MinSize"),
+   64,
+   TEXT("Minimum width and height in pixels of the portal render targets."),
+   ECVF_Scalability);
+
+static TAutoConsoleVariable<int32> CVarPortalRenderTargetFormat(
+   TEXT("r.Portals.RenderTarget.Format"),
+   1,
+   TEXT("Pixel format of the portal render targets, unless set on the portal.\n")
+   TEXT(" 1: RGBA16f, 8 bytes per pixel, best quality\n")
+   TEXT(" 2: R11G11B10f, 4 bytes per pixel, HDR with less precision\n")
+   TEXT(" 3: RGB10A2, 4 bytes per pixel, no HDR\n")
+   TEXT(" 4: RGBA8, 4 bytes per pixel, no HDR and banding"),
+   ECVF_Scalability);
+
+static TAutoConsoleVariable<int32> CVarPortalRenderTargetRecursiveFormat(
+   TEXT("r.Portals.RenderTarget.RecursiveFormat"),
+   0,
+   TEXT("Pixel format of the render targets of the portals seen through other portals, same values as r.Portals.RenderTarget.Format. 0 to keep the format of the portal."),
+   ECVF_Scalability);
+
+static TAutoConsoleVariable<int32> CVarPortalOffAxisProjection(
+   TEXT("r.Portals.OffAxisProjection"),
+   0,
+   TEXT("If set, the captures only render the part of the screen their portal covers, in a render target sized for that part.\n")
+   TEXT("Needs a portal material sampling the textures with their ViewProjection matrix, M_Portal samples them with the screen position."),
+   ECVF_Scalability);
+
+static TAutoConsoleVariable<float> CVarPortalOffAxisProjectionPadding(
+   TEXT("r.Portals.OffAxisProjection.Padding"),
+   0.05f,
+   TEXT("Margin in normalized device coordinates added around the portal, for the frames its texture is reused or it moves on screen."),
+   ECVF_Default);
+
+static TAutoConsoleVariable<int32> CVarPortalObliqueNearPlane(
+   TEXT("r.Portals.ObliqueNearPlane"),
+   0,
+   TEXT("If set, the clip plane of the captures is folded into their projection as an oblique near plane, which also culls what is behind it.\n")
+   TEXT("Effects reconstructing positions from the depth (AO, SSR, fog) are wrong with it, so it is best used with the low capture quality tiers."),
+   ECVF_Scalability);
+
+static TAutoConsoleVariable<int32> CVarPortalRoomCulling(
+   TEXT("r.Portals.RoomCulling"),
+   1,
+   TEXT("If set, a SceneCapture looking into portal room volumes only renders the actors in them."),
+   ECVF_Default);
+
+static TAutoConsoleVariable<float> CVarPortalRoomCullingOffset(
+   TEXT("r.Portals.RoomCulling.Offset"),
+   10.f,
+   TEXT("Distance in cm in front of the portal a SceneCapture looks through at which its rooms are searched."),
+   ECVF_Default);
+
+static TAutoConsoleVariable<float> CVarPortalRenderTargetHysteresis(
+   TEXT("r.Portals.RenderTarget.Hysteresis"),
+   0.15f,
+   TEXT("How far, in fraction of a power of two, the needed size of a portal render target has to go past the limit between two sizes to be resized."),
+   ECVF_Default);
+
+
 UPortalSceneCapture::UPortalSceneCapture(const FObjectInitializer& ObjectInitializer) :
    Super(ObjectInitializer)
 {
-    CachedRenderSize = 0;
-    LastDistanceToCamera = 0.0f;
 }
 
 
@@ -36,35 +113,73 @@ void UPortalSceneCapture::BeginPlay()
       m_weight = 0;
 
    if (!m_linked_portal)
-      m_linked_portal = m_owner;
+      SetLinkedPortal(m_owner);
+
+   // Name of the GPU event of the capture, to find it in GPU profiles and captures
+   ProfilingEventName = FString::Printf(TEXT("Portal %s"), *GetOwner()->GetName());
+}
+
+
+void UPortalSceneCapture::EndPlay(const EEndPlayReason::Type EndPlayReason)
+{
+   // Give the texture back so that other portals can use it
+   if (UPortalRenderTargetPool* render_target_pool = GetWorld()->GetSubsystem<UPortalRenderTargetPool>())
+   {
+      render_target_pool->ReleaseRenderTarget(m_render_target);
+      render_target_pool->ReleaseRenderTarget(m_pending_render_target);
+   }
+
+   SetRenderTarget(nullptr);
+   m_pending_render_target = nullptr;
+
+   Super::EndPlay(EndPlayReason);
 }
 
-void UPortalSceneCapture::UpdateRenderTarget()
+void UPortalSceneCapture::UpdateRenderTarget(const FBox2D& screen_rect, unsigned int depth, const FVector2D& viewport_size, int32& inout_resize_budget)
 {
-    APlayerCameraManager* CameraManager = GetWorld()->GetFirstPlayerController()->PlayerCameraManager;
-    FVector CameraLocation = CameraManager->GetCameraLocation();
-    float Distance = FVector::Dist(CameraLocation, GetComponentLocation());
+   UPortalRenderTargetPool* render_target_pool = GetWorld()->GetSubsystem<UPortalRenderTargetPool>();
+   if (!render_target_pool)
+      return;
+
+   // The texture leased on a previous frame exists on the render thread by now, it can replace the current one
+   if (m_pending_render_target && GFrameCounter > m_pending_render_target_frame)
+   {
+      render_target_pool->ReleaseRenderTarget(m_render_target);
+      SetRenderTarget(m_pending_render_target);
+      m_pending_render_target = nullptr;
+   }
+
+   const FIntPoint size = CalculateRenderSize(screen_rect, depth, viewport_size);
+   const EPortalRenderTargetFormat format = GetRenderTargetFormat(m_owner, depth);
+
+   // Nothing to keep displaying in the meantime
+   if (!m_render_target)
+   {
+      SetRenderTarget(render_target_pool->LeaseRenderTarget(size.X, size.Y, format));
+      return;
+   }
+
+   const UTextureRenderTarget2D* next_render_target = m_pending_render_target ? m_pending_render_target : m_render_target;
+   if (!NeedsNewRenderTarget(next_render_target, screen_rect, depth, viewport_size, format))
+      return;
+
+   // Other portals will resize on the next frames
+   if (inout_resize_budget <= 0)
+      return;
 
-    int32 DesiredSize = CalculateRenderSize(Distance);
+   --inout_resize_budget;
 
-    // Only update if resolution changes significantly
-    if (FMath::Abs((float)DesiredSize - (float)CachedRenderSize) > 32)
-    {
-        // Optional fade-in effect placeholder (e.g. fade in material overlay or delay assignment)
-        UE_LOG(LogTemp, Log, TEXT("Resizing portal render target: %d -> %d (Distance: %.1f)"), CachedRenderSize, DesiredSize, Distance);
+   UE_LOG(LogTemp, Verbose, TEXT("Resizing portal render target of %s: %dx%d -> %dx%d"), *GetOwner()->GetName(), next_render_target->SizeX, next_render_target->SizeY, size.X, size.Y);
 
-        UTextureRenderTarget2D* NewTarget = NewObject<UTextureRenderTarget2D>(this);
-        NewTarget->RenderTargetFormat = ETextureRenderTargetFormat::RTF_RGBA16f;
-        NewTarget->Filter = TF_Bilinear;
-        NewTarget->ClearColor = FLinearColor::Black;
-        NewTarget->InitAutoFormat(DesiredSize, DesiredSize);
-        NewTarget->UpdateResourceImmediate(true);
+   render_target_pool->ReleaseRenderTarget(m_pending_render_target);
+   m_pending_render_target = nullptr;
 
-        TextureTarget = NewTarget;
-        CachedRenderSize = DesiredSize;
-    }
+   // Back to the current texture before the swap
+   if (size == FIntPoint(m_render_target->SizeX, m_render_target->SizeY) && format == UPortalRenderTargetPool::GetFormat(m_render_target))
+      return;
 
-    LastDistanceToCamera = Distance;
+   m_pending_render_target = render_target_pool->LeaseRenderTarget(size.X, size.Y, format);
+   m_pending_render_target_frame = GFrameCounter;
 }
 
 
@@ -96,32 +211,144 @@ void UPortalSceneCapture::Init(ECameraType type, APortal* linked_portal, bool ex
    m_weight = weight;
 }
 
-int32 UPortalSceneCapture::CalculateRenderSize(float Distance) const
+
+void UPortalSceneCapture::SetLinkedPortal(APortal* new_portal)
+{
+   m_linked_portal = new_portal;
+
+   // What can be seen through the SceneCapture has changed
+   if (IsOwnerValid() && m_owner->GetPortalManager())
+      m_owner->GetPortalManager()->MarkVisibilityGraphDirty();
+}
+
+FIntPoint UPortalSceneCapture::CalculateRenderSize(const FBox2D& screen_rect, unsigned int depth, const FVector2D& viewport_size)
+{
+   return QuantizeRenderSize(CalculateDesiredRenderSize(screen_rect, depth, viewport_size), viewport_size);
+}
+
+
+bool UPortalSceneCapture::NeedsNewRenderTarget(const UTextureRenderTarget2D* render_target, const FBox2D& screen_rect, unsigned int depth, const FVector2D& viewport_size, EPortalRenderTargetFormat format)
+{
+   if (!render_target || format != UPortalRenderTargetPool::GetFormat(render_target))
+      return true;
+
+   const FVector2D desired_size = CalculateDesiredRenderSize(screen_rect, depth, viewport_size);
+
+   if (QuantizeRenderSize(desired_size, viewport_size) == FIntPoint(render_target->SizeX, render_target->SizeY))
+      return false;
+
+   // Avoid going back and forth between two sizes when the portal is seen at the limit between them
+   return IsOutsideHysteresisBand(desired_size.X, render_target->SizeX) || IsOutsideHysteresisBand(desired_size.Y, render_target->SizeY);
+}
+
+
+bool UPortalSceneCapture::IsOffAxisProjectionEnabled()
+{
+   return CVarPortalOffAxisProjection.GetValueOnGameThread() != 0;
+}
+
+
+FBox2D UPortalSceneCapture::ComputeCaptureRect(const APortal* portal, const FTransform& watched_actor_transform, const FMatrix& projection_matrix)
+{
+   const FBox2D full_screen(FVector2D(-1.f, -1.f), FVector2D(1.f, 1.f));
+
+   FBox2D capture_rect;
+   if (!IsOffAxisProjectionEnabled() || !Tools::ComputePortalScreenRect(portal, watched_actor_transform, projection_matrix, capture_rect))
+      return full_screen;
+
+   capture_rect = capture_rect.ExpandBy(FMath::Max(CVarPortalOffAxisProjectionPadding.GetValueOnGameThread(), 0.f));
+
+   return capture_rect.Overlap(full_screen);
+}
+
+
+FVector2D UPortalSceneCapture::GetGameViewportSize()
+{
+   FVector2D viewport_size(1920.f, 1080.f);
+
+   if (GEngine && GEngine->GameViewport)
+      GEngine->GameViewport->GetViewportSize(viewport_size);
+
+   return viewport_size;
+}
+
+
+EPortalRenderTargetFormat UPortalSceneCapture::GetRenderTargetFormat(const APortal* portal, unsigned int depth)
+{
+   const EPortalRenderTargetFormat project_format = EPortalRenderTargetFormat(FMath::Clamp(CVarPortalRenderTargetFormat.GetValueOnGameThread(), 1, 4));
+   const EPortalRenderTargetFormat recursive_format = EPortalRenderTargetFormat(FMath::Clamp(CVarPortalRenderTargetRecursiveFormat.GetValueOnGameThread(), 0, 4));
+
+   // Seen through other portals, the texture is small enough for a cheaper format not to be noticed
+   if (depth > 0 && recursive_format != EPortalRenderTargetFormat::Default)
+      return recursive_format;
+
+   if (portal && portal->GetRenderTargetFormat() != EPortalRenderTargetFormat::Default)
+      return portal->GetRenderTargetFormat();
+
+   return project_format;
+}
+
+
+FVector2D UPortalSceneCapture::CalculateDesiredRenderSize(const FBox2D& screen_rect, unsigned int depth, const FVector2D& viewport_size)
+{
+   const float full_resolution_extent = FMath::Max(CVarPortalRenderTargetFullResolutionExtent.GetValueOnGameThread(), KINDA_SMALL_NUMBER);
+   const float depth_scale = FMath::Pow(FMath::Clamp(CVarPortalRenderTargetDepthScale.GetValueOnGameThread(), 0.f, 1.f), float(depth));
+   const float min_size = FMath::Max(CVarPortalRenderTargetMinSize.GetValueOnGameThread(), 1);
+
+   // Fraction of the screen spanned by the portal on each axis, the screen is 2x2 in normalized device coordinates
+   const FVector2D screen_extent = screen_rect.bIsValid ? screen_rect.GetSize() * 0.5f : FVector2D::ZeroVector;
+
+   FVector2D size = viewport_size * depth_scale;
+
+   // Without the crop, the capture covers the whole view whatever the size of the portal, a smaller texture would undersample it
+   if (IsOffAxisProjectionEnabled())
+   {
+      // Same pixel density as a texture covering the whole screen, but only over the part the capture renders
+      size.X *= screen_extent.X * FMath::Min(screen_extent.X / full_resolution_extent, 1.f);
+      size.Y *= screen_extent.Y * FMath::Min(screen_extent.Y / full_resolution_extent, 1.f);
+   }
+
+   // Never bigger than the screen, which is what the texture is mapped onto
+   size.X = FMath::Clamp(size.X, FMath::Min(min_size, viewport_size.X), viewport_size.X);
+   size.Y = FMath::Clamp(size.Y, FMath::Min(min_size, viewport_size.Y), viewport_size.Y);
+
+   return size;
+}
+
+
+FIntPoint UPortalSceneCapture::QuantizeRenderSize(const FVector2D& size, const FVector2D& viewport_size)
 {
-    constexpr float NearDistance = 300.f;
-    constexpr float FarDistance = 2000.f;
-    constexpr int32 MaxTextureSize = 1024;
-    constexpr int32 MinTextureSize = 256;
+   // Nearest power of two, so that portals of close sizes share the same pool buckets
+   const FIntPoint quantized_size(1 << FMath::RoundToInt(FMath::Log2(FMath::Max(size.X, 1.f))),
+                                  1 << FMath::RoundToInt(FMath::Log2(FMath::Max(size.Y, 1.f))));
+
+   // Rounding up can go past the screen, the texture would then have more pixels than it is displayed with
+   return FIntPoint(FMath::Min(quantized_size.X, FMath::Max(FMath::FloorToInt(viewport_size.X), 1)),
+                    FMath::Min(quantized_size.Y, FMath::Max(FMath::FloorToInt(viewport_size.Y), 1)));
+}
 
-    float Alpha = FMath::Clamp((Distance - NearDistance) / (FarDistance - NearDistance), 0.f, 1.f);
-    int32 Size = FMath::Lerp(MaxTextureSize, MinTextureSize, Alpha);
-    Size = FMath::RoundUpToPowerOfTwo(Size);
 
-    // Clamp to screen size
-    FVector2D ViewportSize;
-    if (GEngine && GEngine->GameViewport)
-    {
-        GEngine->GameViewport->GetViewportSize(ViewportSize);
-        int32 ScreenMin = FMath::RoundUpToPowerOfTwo(FMath::Min(ViewportSize.X, ViewportSize.Y));
-        Size = FMath::Clamp(Size, MinTextureSize, ScreenMin);
-    }
+bool UPortalSceneCapture::IsOutsideHysteresisBand(float size, int32 bucket_size)
+{
+   // Buckets change half way between two powers of two, the band pushes that limit further on both sides
+   const float band = FMath::Pow(2.f, 0.5f + FMath::Max(CVarPortalRenderTargetHysteresis.GetValueOnGameThread(), 0.f));
 
-    return Size;
+   return size > bucket_size * band || size < bucket_size / band;
 }
 
 
 void UPortalSceneCapture::Update(const FTransform& watched_actor_transfo, const FMatrix& projection_matrix)
 {
+   UpdateView(watched_actor_transfo, projection_matrix);
+
+   Capture();
+}
+
+
+void UPortalSceneCapture::UpdateView(const FTransform& watched_actor_transfo, const FMatrix& projection_matrix)
+{
+   SCOPE_CYCLE_COUNTER(STAT_PortalSceneCaptureUpdate);
+
    if (!m_render_target || m_render_target->GetFName().IsNone())
       GenerateDefaultTexture();
 
@@ -136,15 +363,105 @@ void UPortalSceneCapture::Update(const FTransform& watched_actor_transfo, const
          UpdateNearClipPlane();
       }
 
-      TextureTarget = m_render_target;
+      UpdateRoomCulling();
 
+      // The texture is bound by the portal for every node and view, see APortal::SetSceneCaptureRenderTargets
       CustomProjectionMatrix = projection_matrix;
-      
+
+      UpdateObliqueNearPlane();
+   }
+}
+
+
+void UPortalSceneCapture::UpdateRoomCulling()
+{
+   TArray<APortalRoomVolume*> rooms;
+
+   // What the SceneCapture sees starts on the side of the clip plane that is kept
+   if (m_linked_portal && m_owner->GetPortalManager() && CVarPortalRoomCulling.GetValueOnGameThread())
+      m_owner->GetPortalManager()->GetRoomsAt(ClipPlaneBase + ClipPlaneNormal.GetSafeNormal() * CVarPortalRoomCullingOffset.GetValueOnGameThread(), rooms);
+
+   // The list of actors is only rebuilt when the SceneCapture looks into other rooms, or when actors entered or left them
+   uint32 rooms_hash = rooms.Num();
+   for (const APortalRoomVolume* room : rooms)
+      rooms_hash = HashCombine(rooms_hash, HashCombine(GetTypeHash(room), room->GetRevision()));
+
+   if (rooms_hash == m_rooms_hash)
+      return;
+
+   m_rooms_hash = rooms_hash;
+
+   ShowOnlyActors.Reset();
+
+   if (rooms.Num() == 0)
+   {
+      PrimitiveRenderMode = ESceneCapturePrimitiveRenderMode::PRM_RenderScenePrimitives;
+      return;
+   }
+
+   TArray<AActor*> visible_actors;
+   for (const APortalRoomVolume* room : rooms)
+      room->GetVisibleActors(visible_actors);
+
+   for (AActor* actor : visible_actors)
+      ShowOnlyActors.Add(actor);
+
+   PrimitiveRenderMode = ESceneCapturePrimitiveRenderMode::PRM_UseShowOnlyList;
+}
+
+
+void UPortalSceneCapture::UpdateObliqueNearPlane()
+{
+   const bool can_fold_clip_plane = m_linked_portal && (bEnableClipPlane || m_is_clip_plane_in_projection) && CVarPortalObliqueNearPlane.GetValueOnGameThread();
+
+   FMatrix oblique_projection_matrix;
+
+   // Fails if the SceneCapture is on the visible side of the clip plane
+   if (can_fold_clip_plane && Tools::ComputeObliqueProjectionMatrix(CustomProjectionMatrix, Tools::ComputeViewMatrix(GetComponentTransform()), FPlane(ClipPlaneBase, ClipPlaneNormal.GetSafeNormal()), oblique_projection_matrix))
+   {
+      CustomProjectionMatrix = oblique_projection_matrix;
+      bEnableClipPlane = false;
+      m_is_clip_plane_in_projection = true;
+   }
+   else if (m_is_clip_plane_in_projection)
+   {
+      bEnableClipPlane = true;
+      m_is_clip_plane_in_projection = false;
+   }
+}
+
+
+void UPortalSceneCapture::Capture()
+{
+   SCOPE_CYCLE_COUNTER(STAT_PortalCaptureScene);
+   TRACE_CPUPROFILER_EVENT_SCOPE(UPortalSceneCapture::Capture);
+
+   if (IsOwnerValid() && TextureTarget)
+   {
+      INC_DWORD_STAT(STAT_PortalCaptures);
+
       CaptureScene();
+      ++m_capture_count;
    }
 }
 
 
+void UPortalSceneCapture::ApplyQualityTier(const FPortalCaptureQualityTier& quality_tier)
+{
+   PostProcessSettings.AmbientOcclusionQuality = quality_tier.ambient_occlusion_quality;
+   PostProcessSettings.ScreenSpaceReflectionQuality = quality_tier.screen_space_reflection_quality;
+
+   ShowFlags.SetAmbientOcclusion(quality_tier.ambient_occlusion_quality > 0.f);
+   ShowFlags.SetScreenSpaceReflections(quality_tier.screen_space_reflection_quality > 0.f);
+   ShowFlags.SetDynamicShadows(quality_tier.dynamic_shadows);
+   ShowFlags.SetParticles(quality_tier.particles);
+   ShowFlags.SetTranslucency(quality_tier.translucency);
+   ShowFlags.SetFog(quality_tier.fog);
+
+   LODDistanceFactor = quality_tier.lod_distance_factor;
+}
+
+
 void UPortalSceneCapture::UpdateTransformation_Implementation(const FTransform& watched_actor_transfo)
 {
    if (IsOwnerValid())
@@ -208,43 +525,21 @@ void UPortalSceneCapture::UpdateNearClipPlane_Implementation()
 
 void UPortalSceneCapture::GenerateDefaultTexture()
 {
+   // The real size is set by UpdateRenderTarget once the portal is seen
+   const FIntPoint size = CalculateRenderSize(FBox2D(FVector2D(-1.f, -1.f), FVector2D(1.f, 1.f)), 1, GetGameViewportSize());
+
+   UPortalRenderTargetPool* render_target_pool = GetWorld()->GetSubsystem<UPortalRenderTargetPool>();
+   if (!render_target_pool)
+      return;
 
-   float Distance = LastDistanceToCamera;
-    if (Distance == 0.f)
-    {
-        APlayerCameraManager* CameraManager = GetWorld()->GetFirstPlayerController()->PlayerCameraManager;
-        Distance = FVector::Dist(CameraManager->GetCameraLocation(), GetComponentLocation());
-    }
-   
-  // int32 current_size_x = 1920;
-  // int32 current_size_y = 1080;
-
-   int32 CurrentSize = CalculateRenderSize(Distance);
-   CachedRenderSize = CurrentSize;
-
-
-  // // Use a smaller size than the current screen to reduce the performance impact
- //  current_size_x = FMath::Clamp(int(current_size_x / 1.7), 128, 1920);
- //  current_size_y = FMath::Clamp(int(current_size_y / 1.7), 128, 1080);
-
-   // Create new RTT
-   m_render_target = NewObject<UTextureRenderTarget2D>(this, UTextureRenderTarget2D::StaticClass(), FName("Default texture"));
-
-   m_render_target->RenderTargetFormat = ETextureRenderTargetFormat::RTF_RGBA16f;
-   m_render_target->Filter = TextureFilter::TF_Bilinear;
-   m_render_target->SizeX = CurrentSize;
-   m_render_target->SizeY = CurrentSize;
-   m_render_target->ClearColor = FLinearColor::Blue;
-   m_render_target->TargetGamma = 2.2f;
-   m_render_target->bNeedsTwoCopies = false;
-   m_render_target->AddressX = TextureAddress::TA_Clamp;
-   m_render_target->AddressY = TextureAddress::TA_Clamp;
-
-   // Not needed since the texture is displayed on screen directly
-   // in some engine versions this can even lead to crashes (notably 4.24/4.25)
-   m_render_target->bAutoGenerateMips = false;
-
-   // This force the engine to create the render target 
-   // with the parameters we defined just above
-   m_render_target->UpdateResource();
+   // Get a RTT from the pool, the previous one can be reused by other portals
+   UTextureRenderTarget2D* previous_render_target = m_render_target;
+
+   render_target_pool->ReleaseRenderTarget(m_render_target);
+   // Stands in for the texture of the portal seen directly, so has its format and not the recursive one
+   m_render_target = render_target_pool->LeaseRenderTarget(size.X, size.Y, GetRenderTargetFormat(Cast<APortal>(GetOwner()), 0));
+
+   // Another texture may be bound for the current node
+   if (!TextureTarget || TextureTarget == previous_render_target)
+      TextureTarget = m_render_target;
 }
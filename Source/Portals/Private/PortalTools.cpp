@@ -7,11 +7,21 @@
 #include <Kismet/GameplayStatics.h>
 #include <Kismet/KismetMathLibrary.h> 
 #include <Camera/CameraComponent.h>
+#include <HAL/IConsoleManager.h>
 
+#include "PortalQualitySettings.h"
 #include "PortalSceneCapture.h"
+#include "PortalStats.h"
 #include "Portal.h"
 
 
+static TAutoConsoleVariable<float> CVarPortalEmbeddedDistance(
+   TEXT("r.Portals.EmbeddedDistance"),
+   -1.f,
+   TEXT("Distance in cm under which an impact hiding a vertex of a portal is considered to be the wall the portal is embedded in. Negative to use the project settings."),
+   ECVF_Default);
+
+
 FTransform Tools::ComputeNewTransform(const FTransform& watched_actor_transfo, const APortal* reference, const UPortalSceneCapture* scene_capture)
 {
    FTransform new_transform;
@@ -106,39 +116,220 @@ FRotator Tools::ComputeNewPortalRotation(const FQuat& rotation, const APortal* r
 
 bool Tools::isPortalVisibleToCamera(APortal* portal, USceneComponent* camera, float near_plane_distance)
 {
+   // If the portal is behind the camera is not in the camera frustum, we don't render it
+   return isPortalInCameraView(portal, camera, near_plane_distance) && !isPortalOccluded(portal, camera);
+}
+
+
+bool Tools::isPortalInCameraView(APortal* portal, USceneComponent* camera, float near_plane_distance)
+{
+   TRACE_CPUPROFILER_EVENT_SCOPE(Tools::isPortalInCameraView);
+
    float distance = FMath::Abs(FVector::Dist(camera->GetComponentLocation(), portal->GetActorLocation()));
    if (distance > APortal::GetActivePortalDistance())
       return false;
 
    bool is_camera_in_front_of_portal = FVector::DotProduct(portal->GetActorForwardVector(), camera->GetComponentLocation() - portal->GetActorLocation()) > 0;
 
-   // If the portal is behind the camera is not in the camera frustum, we don't render it
-   if (is_camera_in_front_of_portal && isActorInCameraViewFrustum(portal, camera, near_plane_distance))
+   return is_camera_in_front_of_portal && isActorInCameraViewFrustum(portal, camera, near_plane_distance);
+}
+
+
+bool Tools::isPortalOccluded(APortal* portal, USceneComponent* camera)
+{
+   TRACE_CPUPROFILER_EVENT_SCOPE(Tools::isPortalOccluded);
+
+   const FCollisionQueryParams params = GetVertexTraceParams(portal, camera);
+
+   for (const FVector& vertex : *(portal->GetMeshVertices()))
    {
-      for (const FVector& vertex : *(portal->GetMeshVertices()))
+      FHitResult hit_result;
+      // If one vertex of the portal is directly visible (not hidden) to the camera, we render it
+      if (!IsVertexHidden(hit_result, camera, vertex, params))
+         return false;
+      else
       {
-         FCollisionQueryParams params(FName("Vertex visibility from camera"), true, portal);
-         FHitResult hit_result;
-         // If one vertex of the portal is directly visible (not hidden) to the camera, we render it
-         if (!IsVertexHidden(hit_result, camera, vertex, params))
-            return true;
-         else
-         {
-            float distance_to_portal = FVector::Distance(hit_result.Location, vertex);
-
-            // If the impact is near the portal, it may be because the portal is integrated in a wall (thus the vertices are hidden)
-            // If so, we render it anyway
-            if (distance_to_portal < 150)
-               return true;
-         }
+         float distance_to_portal = FVector::Distance(hit_result.Location, vertex);
+
+         // If the impact is near the portal, it may be because the portal is integrated in a wall (thus the vertices are hidden)
+         // If so, we render it anyway
+         if (distance_to_portal < GetEmbeddedPortalDistance())
+            return false;
       }
    }
 
-   return false;
+   return true;
+}
+
+
+float Tools::GetEmbeddedPortalDistance()
+{
+   const float embedded_distance = CVarPortalEmbeddedDistance.GetValueOnGameThread();
+
+   return FMath::Max(embedded_distance >= 0.f ? embedded_distance : GetDefault<UPortalQualitySettings>()->GetEmbeddedPortalDistance(), 0.f);
+}
+
+
+FCollisionQueryParams Tools::GetVertexTraceParams(APortal* portal, USceneComponent* camera)
+{
+   FCollisionQueryParams params(FName("Vertex visibility from camera"), true, portal);
+
+   // Behind the linked portal, only the world is traced
+   if (const UPortalSceneCapture* scene_capture = Cast<UPortalSceneCapture>(camera))
+      params.AddIgnoredActor(scene_capture->GetLinkedPortal());
+
+   return params;
+}
+
+
+bool Tools::TraceThroughLinkedPortal(FVector& OUT_start, UPortalSceneCapture* scene_capture, const FVector& vertex, const FCollisionQueryParams& params)
+{
+   APortal* linked_portal = scene_capture->GetLinkedPortal();
+   FVector start, end;
+   FHitResult hit_result;
+
+   // We have to cast the ray in front of the portal for the collision to happen
+   if (scene_capture->IsExitInFront() || scene_capture->getType() == ECameraType::Mirror)
+   {
+      start = vertex;
+      end = scene_capture->GetComponentLocation();
+   }
+   else
+   {
+      start = scene_capture->GetComponentLocation();
+      end = vertex;
+   }
+
+   INC_DWORD_STAT(STAT_PortalLineTraces);
+
+   if (!linked_portal->ActorLineTraceSingle(hit_result, start, end, ECollisionChannel::ECC_Camera, params))
+      return false;
+
+   OUT_start = hit_result.Location;
+
+   return true;
+}
+
+
+FMatrix Tools::ComputeViewMatrix(const FTransform& view_transform)
+{
+   // Same as the engine views : X forward, Y right, Z up to Z depth, X right, Y up
+   return FTranslationMatrix(-view_transform.GetLocation())
+        * FInverseRotationMatrix(view_transform.Rotator())
+        * FMatrix(FPlane(0, 0, 1, 0),
+                  FPlane(1, 0, 0, 0),
+                  FPlane(0, 1, 0, 0),
+                  FPlane(0, 0, 0, 1));
+}
+
+
+bool Tools::ComputePortalScreenRect(const APortal* portal, const FTransform& view_transform, const FMatrix& projection_matrix, FBox2D& OUT_screen_rect)
+{
+   const FBox2D full_screen(FVector2D(-1.f, -1.f), FVector2D(1.f, 1.f));
+   const FMatrix view_projection_matrix = ComputeViewMatrix(view_transform) * projection_matrix;
+
+   OUT_screen_rect = FBox2D(ForceInit);
+
+   for (const FVector& vertex : *(portal->GetMeshVertices()))
+   {
+      const FVector4 clip_position = view_projection_matrix.TransformFVector4(FVector4(vertex, 1.f));
+
+      // A vertex behind the camera can cover anything once the portal is clipped, so we consider the whole screen
+      if (clip_position.W <= KINDA_SMALL_NUMBER)
+      {
+         OUT_screen_rect = full_screen;
+         return true;
+      }
+
+      OUT_screen_rect += FVector2D(clip_position.X / clip_position.W, clip_position.Y / clip_position.W);
+   }
+
+   if (!OUT_screen_rect.bIsValid || !OUT_screen_rect.Intersect(full_screen))
+      return false;
+
+   OUT_screen_rect = OUT_screen_rect.Overlap(full_screen);
+
+   return true;
+}
+
+
+FMatrix Tools::ComputeCropMatrix(const FBox2D& screen_rect)
+{
+   const FVector2D center = screen_rect.GetCenter();
+   const FVector2D extent(FMath::Max(screen_rect.GetExtent().X, KINDA_SMALL_NUMBER), FMath::Max(screen_rect.GetExtent().Y, KINDA_SMALL_NUMBER));
+
+   // Scale and offset of the clip space position, before the division by W
+   return FMatrix(FPlane(1.f / extent.X, 0.f, 0.f, 0.f),
+                  FPlane(0.f, 1.f / extent.Y, 0.f, 0.f),
+                  FPlane(0.f, 0.f, 1.f, 0.f),
+                  FPlane(-center.X / extent.X, -center.Y / extent.Y, 0.f, 1.f));
+}
+
+
+bool Tools::ComputeObliqueProjectionMatrix(const FMatrix& projection_matrix, const FMatrix& view_matrix, const FPlane& clip_plane, FMatrix& OUT_projection_matrix)
+{
+   // W has to be the view depth, and the depth near / W
+   if (projection_matrix.M[2][3] != 1.f || projection_matrix.M[3][3] != 0.f)
+      return false;
+
+   const FPlane view_clip_plane = clip_plane.TransformBy(view_matrix);
+
+   // Nothing in front of the camera would be clipped
+   if (view_clip_plane.PlaneDot(FVector::ZeroVector) >= 0.f)
+      return false;
+
+   // The depth becomes 1 on the plane and decreases with the distance to it
+   // It is scaled for no direction of the frustum to reach a depth of 0, where the far plane would cut it
+   float max_plane_dot = 0.f;
+
+   for (const FVector2D& corner : { FVector2D(-1.f, -1.f), FVector2D(-1.f, 1.f), FVector2D(1.f, -1.f), FVector2D(1.f, 1.f) })
+   {
+      const FVector direction((corner.X - projection_matrix.M[2][0]) / projection_matrix.M[0][0],
+                              (corner.Y - projection_matrix.M[2][1]) / projection_matrix.M[1][1],
+                              1.f);
+
+      max_plane_dot = FMath::Max(max_plane_dot, float(FVector::DotProduct(FVector(view_clip_plane), direction)));
+   }
+
+   const float scale = max_plane_dot > 1.f ? 1.f / max_plane_dot : 1.f;
+
+   OUT_projection_matrix = projection_matrix;
+   OUT_projection_matrix.M[0][2] = -scale * view_clip_plane.X;
+   OUT_projection_matrix.M[1][2] = -scale * view_clip_plane.Y;
+   OUT_projection_matrix.M[2][2] = 1.f - scale * view_clip_plane.Z;
+   OUT_projection_matrix.M[3][2] = scale * view_clip_plane.W;
+
+   return true;
+}
+
+
+float Tools::ComputePortalScreenCoverage(const APortal* portal, const FTransform& view_transform, const FMatrix& projection_matrix)
+{
+   FBox2D screen_rect;
+
+   if (!ComputePortalScreenRect(portal, view_transform, projection_matrix, screen_rect))
+      return 0.f;
+
+   // The screen is 2x2 in normalized device coordinates
+   return screen_rect.GetArea() / 4.f;
 }
 
 
 bool Tools::isActorInCameraViewFrustum(AActor* actor, USceneComponent* camera, float near_plane_distance)
+{
+   FConvexVolume frustum;
+   if (!ComputeCameraFrustum(camera, near_plane_distance, frustum))
+      return false;
+
+   // Get the bounding box of the actor
+   FVector portal_origin, portal_extent;
+   actor->GetActorBounds(true, portal_origin, portal_extent, false);
+
+   return frustum.IntersectBox(portal_origin, portal_extent);
+}
+
+
+bool Tools::ComputeCameraFrustum(USceneComponent* camera, float near_plane_distance, FConvexVolume& OUT_frustum)
 {
    FMinimalViewInfo view_info;
 
@@ -151,7 +342,7 @@ bool Tools::isActorInCameraViewFrustum(AActor* actor, USceneComponent* camera, f
       Cast<USceneCaptureComponent2D>(camera)->GetCameraView(0, view_info);
       view_info.OrthoNearClipPlane = near_plane_distance;
    }
-   
+
    else
       return false;
 
@@ -159,15 +350,9 @@ bool Tools::isActorInCameraViewFrustum(AActor* actor, USceneComponent* camera, f
    FMatrix view_matrix, projection_matrix, view_projection_matrix;
    UGameplayStatics::GetViewProjectionMatrix(view_info, view_matrix, projection_matrix, view_projection_matrix);
 
-   // Get the camera frustum
-   FConvexVolume frustum;
-   GetViewFrustumBounds(frustum, view_projection_matrix, true);
+   GetViewFrustumBounds(OUT_frustum, view_projection_matrix, true);
 
-   // Get the bounding box of the actor
-   FVector portal_origin, portal_extent;
-   actor->GetActorBounds(true, portal_origin, portal_extent, false);
-
-   return frustum.IntersectBox(portal_origin, portal_extent);
+   return true;
 }
 
 
@@ -216,44 +401,32 @@ float Tools::ComputeRefractionAngle(float incidence_angle, float n1, float n2)
 }
 
 
-bool Tools::IsVertexHidden(FHitResult& OUT_hit_result, USceneComponent* camera, const FVector& vertex, FCollisionQueryParams& params)
+bool Tools::IsVertexHidden(FHitResult& OUT_hit_result, USceneComponent* camera, const FVector& vertex, const FCollisionQueryParams& params)
 {
    ECollisionChannel collision_channel = ECollisionChannel::ECC_Camera;
 
    // If it's the player camera, we do a simple ray cast test
    if (camera->IsA(UCameraComponent::StaticClass()))
+   {
+      INC_DWORD_STAT(STAT_PortalLineTraces);
       return camera->GetWorld()->LineTraceSingleByChannel(OUT_hit_result, camera->GetComponentLocation(), vertex, collision_channel, params);
+   }
 
    // If it's a scene capture
    else if (camera->IsA(UPortalSceneCapture::StaticClass()))
    {
       UPortalSceneCapture* scene_capture = Cast<UPortalSceneCapture>(camera);
-      APortal* linked_portal = scene_capture->GetLinkedPortal();
-      FVector start, end;
-
-      // We have to cast the ray in front of the portal for the collision to happen
-      if (scene_capture->IsExitInFront() || scene_capture->getType() == ECameraType::Mirror)
-      {
-         start = vertex;
-         end = camera->GetComponentLocation();
-      }
-      else
-      {
-         start = camera->GetComponentLocation();
-         end = vertex;
-      }
-
-      bool is_vertex_visible_inside_linked_portal = linked_portal->ActorLineTraceSingle(OUT_hit_result, start, end, collision_channel, params);
+      FVector start;
 
       // If the vertex is not visible inside linked portal, it's hidden
-      if (!is_vertex_visible_inside_linked_portal)
+      if (!TraceThroughLinkedPortal(start, scene_capture, vertex, params))
          return true;
 
       // Otherwise, we check if it's not hidden behind something behind linked_portal
       else
       {
-         params.AddIgnoredActor(linked_portal);
-         return camera->GetWorld()->LineTraceSingleByChannel(OUT_hit_result, OUT_hit_result.Location, vertex, collision_channel, params);
+         INC_DWORD_STAT(STAT_PortalLineTraces);
+         return camera->GetWorld()->LineTraceSingleByChannel(OUT_hit_result, start, vertex, collision_channel, params);
       }
    }
 
@@ -0,0 +1,53 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#include "PortalWorldSubsystem.h"
+
+#include <Engine/World.h>
+
+#include "PortalManager.h"
+
+
+void FPortalTickFunction::ExecuteTick(float DeltaTime, ELevelTick TickType, ENamedThreads::Type CurrentThread, const FGraphEventRef& MyCompletionGraphEvent)
+{
+   if (subsystem && TickType != LEVELTICK_ViewportsOnly)
+      subsystem->Tick(DeltaTime);
+}
+
+
+void UPortalWorldSubsystem::OnWorldBeginPlay(UWorld& world)
+{
+   Super::OnWorldBeginPlay(world);
+
+   // After the camera updates, for the captures to be made from the cameras of this frame
+   m_tick_function.TickGroup = TG_PostUpdateWork;
+   m_tick_function.bCanEverTick = true;
+   m_tick_function.bStartWithTickEnabled = true;
+   m_tick_function.subsystem = this;
+
+   m_tick_function.RegisterTickFunction(world.PersistentLevel);
+}
+
+
+void UPortalWorldSubsystem::Deinitialize()
+{
+   if (m_tick_function.IsTickFunctionRegistered())
+      m_tick_function.UnRegisterTickFunction();
+
+   m_tick_function.subsystem = nullptr;
+   m_portal_manager = nullptr;
+
+   Super::Deinitialize();
+}
+
+
+void UPortalWorldSubsystem::Tick(float DeltaSeconds)
+{
+   if (IsValid(m_portal_manager))
+      m_portal_manager->Update(DeltaSeconds);
+}
+
+
+bool UPortalWorldSubsystem::DoesSupportWorldType(EWorldType::Type world_type) const
+{
+   return world_type == EWorldType::Game || world_type == EWorldType::PIE;
+}
@@ -3,8 +3,32 @@
 #include "Portals.h"
 #include "GameFramework/InputSettings.h" 
 
+#include "PortalStats.h"
+
 #define LOCTEXT_NAMESPACE "FPortalsModule"
 
+DEFINE_STAT(STAT_PortalUpdateVisiblePortals);
+DEFINE_STAT(STAT_PortalBuildRenderTree);
+DEFINE_STAT(STAT_PortalRenderTree);
+DEFINE_STAT(STAT_PortalVisibilityTest);
+DEFINE_STAT(STAT_PortalSceneCaptureUpdate);
+DEFINE_STAT(STAT_PortalCaptureScene);
+DEFINE_STAT(STAT_PortalUpdateTexture);
+DEFINE_STAT(STAT_PortalUpdateCrossings);
+DEFINE_STAT(STAT_PortalUpdateStreaming);
+
+DEFINE_STAT(STAT_PortalsVisible);
+DEFINE_STAT(STAT_PortalCaptures);
+DEFINE_STAT(STAT_PortalMaxDepth);
+DEFINE_STAT(STAT_PortalLineTraces);
+DEFINE_STAT(STAT_PortalTextureCopies);
+DEFINE_STAT(STAT_PortalTeleports);
+DEFINE_STAT(STAT_PortalSharedCaptures);
+DEFINE_STAT(STAT_PortalStreamingDestinations);
+
+DEFINE_STAT(STAT_PortalRenderTargetMemory);
+DEFINE_STAT(STAT_PortalFreeRenderTargetMemory);
+
 void FPortalsModule::StartupModule()
 {
    SetKeybindings();
@@ -8,13 +8,12 @@
 ASimplePortal::ASimplePortal(const FObjectInitializer& ObjectInitializer) :
    Super(ObjectInitializer)
 {
-   PrimaryActorTick.bCanEverTick = true;
 }
 
 
-void ASimplePortal::BeginPlay()
+void ASimplePortal::PostInitializeComponents()
 {
-   Super::BeginPlay();
+   Super::PostInitializeComponents();
 
    if (m_type != ECameraType::Portal || !m_linked_portal)
    {
@@ -24,6 +23,14 @@ void ASimplePortal::BeginPlay()
 }
 
 
+void ASimplePortal::SetLink(ECameraType type, APortal* linked_portal, bool exit_in_front)
+{
+   m_type = type;
+   m_linked_portal = linked_portal;
+   m_exit_in_front = exit_in_front;
+}
+
+
 void ASimplePortal::SetSceneCaptures()
 {
    UPortalSceneCapture* scene_capture = CreateDefaultSceneCapture();
@@ -2,9 +2,13 @@
 
 #include "TeleporterPortal.h"
 
+#include <Camera/CameraComponent.h>
+#include <Components/BoxComponent.h>
 #include <GameFramework/CharacterMovementComponent.h>
 #include <GameFramework/Character.h>
 
+#include "PortalCharacter.h"
+#include "PortalManager.h"
 #include "PortalSceneCapture.h"
 
 
@@ -12,19 +16,49 @@ ATeleporterPortal::ATeleporterPortal(const FObjectInitializer& ObjectInitializer
    Super(ObjectInitializer),
    m_last_in_front(false)
 {
-   PrimaryActorTick.bCanEverTick = true;
+   m_crossing_box = CreateDefaultSubobject<UBoxComponent>(TEXT("CrossingBox"));
+   m_crossing_box->AttachToComponent(RootComponent, FAttachmentTransformRules(EAttachmentRule::KeepRelative, false));
+   m_crossing_box->InitBoxExtent(FVector(50.f, 100.f, 150.f));
+   m_crossing_box->SetCollisionProfileName(TEXT("Trigger"));
+   m_crossing_box->SetGenerateOverlapEvents(true);
 }
 
 
-void ATeleporterPortal::BeginPlay()
+void ATeleporterPortal::PostInitializeComponents()
 {
-   Super::BeginPlay();
+   Super::PostInitializeComponents();
 
    if (!m_linked_portal)
       m_linked_portal = this;
 }
 
 
+void ATeleporterPortal::BeginPlay()
+{
+   Super::BeginPlay();
+
+   if (m_is_native_crossing_enabled)
+   {
+      m_crossing_box->OnComponentBeginOverlap.AddDynamic(this, &ATeleporterPortal::OnCrossingBoxBeginOverlap);
+      m_crossing_box->OnComponentEndOverlap.AddDynamic(this, &ATeleporterPortal::OnCrossingBoxEndOverlap);
+
+      // Actors already inside the box when the game starts don't trigger a begin overlap
+      TArray<AActor*> overlapping_actors;
+      m_crossing_box->GetOverlappingActors(overlapping_actors);
+
+      for (AActor* actor : overlapping_actors)
+         StartTracking(actor);
+   }
+}
+
+
+void ATeleporterPortal::SetLinkedPortal(APortal* linked_portal, bool exit_in_front)
+{
+   m_linked_portal = linked_portal;
+   m_exit_in_front = exit_in_front;
+}
+
+
 void ATeleporterPortal::SetSceneCaptures()
 {
    UPortalSceneCapture* scene_capture = CreateDefaultSceneCapture();
@@ -45,6 +79,10 @@ bool ATeleporterPortal::IsPointInFrontOfPortal(FVector point) const
 
 bool ATeleporterPortal::IsCrossingPortal(FVector position)
 {
+   // The tracked actors are already teleported by the manager
+   if (m_is_native_crossing_enabled)
+      return false;
+
    bool is_in_front = IsPointInFrontOfPortal(position);
 
    // Did we cross the portal in the right direction (we're not in front of it anymore)?
@@ -61,7 +99,7 @@ void ATeleporterPortal::TeleportActor(AActor* actor_to_teleport)
    if (actor_to_teleport == nullptr || m_linked_portal == nullptr)
       return;
 
-   actor_to_teleport->SetActorTransform(Tools::ComputeNewTransform(actor_to_teleport->GetTransform(), this, m_scene_captures[0]));
+   actor_to_teleport->SetActorTransform(Tools::ComputeNewTransform(actor_to_teleport->GetTransform(), this, m_scene_captures[0]), false, nullptr, ETeleportType::TeleportPhysics);
 
    // If we are teleporting a character we need to update its controller and reapply its velocity
    if (actor_to_teleport->IsA(APortalCharacter::StaticClass()))
@@ -76,15 +114,133 @@ void ATeleporterPortal::TeleportActor(AActor* actor_to_teleport)
          player_controller->SetControlRotation(Tools::ComputeNewPortalRotation(FQuat(player_controller->GetControlRotation()), this, this->m_scene_captures[0]));
 
       // Reapply Velocity
-      FVector local_velocity;
-      local_velocity.X = FVector::DotProduct(saved_velocity, GetActorForwardVector());
-      local_velocity.Y = FVector::DotProduct(saved_velocity, GetActorRightVector());
-      local_velocity.Z = FVector::DotProduct(saved_velocity, GetActorUpVector());
+      player->GetCharacterMovement()->Velocity = ComputeExitVelocity(saved_velocity);
+   }
+
+   // Physics props keep their momentum through the portal
+   else if (UPrimitiveComponent* root_primitive = Cast<UPrimitiveComponent>(actor_to_teleport->GetRootComponent()))
+   {
+      if (root_primitive->IsSimulatingPhysics())
+      {
+         root_primitive->SetPhysicsLinearVelocity(ComputeExitVelocity(root_primitive->GetPhysicsLinearVelocity()));
+         root_primitive->SetPhysicsAngularVelocityInDegrees(ComputeExitVelocity(root_primitive->GetPhysicsAngularVelocityInDegrees()));
+      }
+   }
+
+   // The actor may still overlap this portal or already overlap the exit one, its movement starts again from where it now is
+   RestartTracking(actor_to_teleport);
+
+   if (ATeleporterPortal* linked_teleporter = Cast<ATeleporterPortal>(m_linked_portal))
+      linked_teleporter->RestartTracking(actor_to_teleport);
+
+   if (m_portal_manager)
+      m_portal_manager->NotifyActorTeleported(actor_to_teleport);
+}
+
+
+FVector ATeleporterPortal::ComputeExitVelocity(const FVector& velocity) const
+{
+   FVector local_velocity;
+   local_velocity.X = FVector::DotProduct(velocity, GetActorForwardVector());
+   local_velocity.Y = FVector::DotProduct(velocity, GetActorRightVector());
+   local_velocity.Z = FVector::DotProduct(velocity, GetActorUpVector());
+
+   return (local_velocity.X * m_linked_portal->GetActorForwardVector()
+         + local_velocity.Y * m_linked_portal->GetActorRightVector()) * (m_exit_in_front ? -1 : 1)
+         + local_velocity.Z * m_linked_portal->GetActorUpVector();
+}
+
+
+void ATeleporterPortal::UpdateCrossings(TArray<AActor*>& OUT_crossing_actors)
+{
+   // Backwards, for the destroyed actors to be removed while iterating
+   for (int32 index = m_tracked_actors.Num() - 1; index >= 0; --index)
+   {
+      AActor* actor = m_tracked_actors[index].Get();
+
+      if (!actor)
+      {
+         m_tracked_actors.RemoveAtSwap(index);
+         m_tracked_points.RemoveAtSwap(index);
+         continue;
+      }
+
+      const FVector point = GetTrackedPoint(actor);
+
+      // Swept test from the last point, for fast actors not to go through without ever being sampled behind the plane inside the box
+      if (IsSegmentCrossingPortal(m_tracked_points[index], point))
+         OUT_crossing_actors.Add(actor);
 
-      FVector NewVelocity = (local_velocity.X * m_linked_portal->GetActorForwardVector()
-                           + local_velocity.Y * m_linked_portal->GetActorRightVector()) * (m_exit_in_front ? -1 : 1)
-                           + local_velocity.Z * m_linked_portal->GetActorUpVector();
+      m_tracked_points[index] = point;
+   }
+}
+
+
+void ATeleporterPortal::OnCrossingBoxBeginOverlap(UPrimitiveComponent* overlapped_component, AActor* other_actor, UPrimitiveComponent* other_component, int32 other_body_index, bool from_sweep, const FHitResult& sweep_result)
+{
+   StartTracking(other_actor);
+}
+
+
+void ATeleporterPortal::OnCrossingBoxEndOverlap(UPrimitiveComponent* overlapped_component, AActor* other_actor, UPrimitiveComponent* other_component, int32 other_body_index)
+{
+   // Actors with several components only leave when the last one does
+   if (!other_actor || m_crossing_box->IsOverlappingActor(other_actor))
+      return;
 
-      player->GetCharacterMovement()->Velocity = NewVelocity;
+   const int32 index = m_tracked_actors.IndexOfByKey(other_actor);
+
+   if (index != INDEX_NONE)
+   {
+      m_tracked_actors.RemoveAtSwap(index);
+      m_tracked_points.RemoveAtSwap(index);
    }
-}
\ No newline at end of file
+}
+
+
+void ATeleporterPortal::StartTracking(AActor* actor)
+{
+   if (!actor || actor == this || m_tracked_actors.Contains(actor))
+      return;
+
+   m_tracked_actors.Add(actor);
+   m_tracked_points.Add(GetTrackedPoint(actor));
+}
+
+
+void ATeleporterPortal::RestartTracking(const AActor* actor)
+{
+   const int32 index = m_tracked_actors.IndexOfByKey(actor);
+
+   if (index != INDEX_NONE)
+      m_tracked_points[index] = GetTrackedPoint(actor);
+}
+
+
+FVector ATeleporterPortal::GetTrackedPoint(const AActor* actor)
+{
+   const APortalCharacter* character = Cast<APortalCharacter>(actor);
+
+   if (character && character->GetPlayerCamera())
+      return character->GetPlayerCamera()->GetComponentLocation();
+
+   return actor->GetActorLocation();
+}
+
+
+bool ATeleporterPortal::IsSegmentCrossingPortal(const FVector& start, const FVector& end) const
+{
+   const FPlane portal_plane = GetPortalPlane();
+   const float start_distance = portal_plane.PlaneDot(start);
+   const float end_distance = portal_plane.PlaneDot(end);
+
+   // Same direction as IsCrossingPortal, from in front of the portal to behind it
+   if (start_distance < 0.f || end_distance >= 0.f)
+      return false;
+
+   const FVector intersection = FMath::Lerp(start, end, start_distance / (start_distance - end_distance));
+   const FVector local_intersection = m_crossing_box->GetComponentTransform().InverseTransformPosition(intersection);
+   const FVector box_extent = m_crossing_box->GetUnscaledBoxExtent();
+
+   return FMath::Abs(local_intersection.Y) <= box_extent.Y && FMath::Abs(local_intersection.Z) <= box_extent.Z;
+}
@@ -17,4 +17,21 @@ public:
 	virtual void SetSceneCaptures() override;
 	
 	void AddSceneCapture(UPortalSceneCapture* scene_capture_actor);
+
+	// The SceneCaptures whose weight is too low to show once composited are not captured
+	virtual bool IsSceneCaptureSkipped(int32 scene_capture_index) const override;
+
+	// The SceneCaptures with a low weight are mostly hidden by the others once composited, so are captured in lower resolution
+	virtual float GetSceneCaptureResolutionScale(int32 scene_capture_index) const override;
+
+protected:
+	virtual bool ShouldCompositeCaptures() const override;
+
+private:
+	// Weight of the SceneCapture relative to the sum of the weights of all SceneCaptures of the portal
+	float GetNormalizedWeight(int32 scene_capture_index) const;
+
+	// Blend the SceneCaptures into one texture even when the material could take them all
+	UPROPERTY(EditAnywhere, Category = "Portal|Material", DisplayName = "Composite captures")
+	bool m_composite_captures = false;
 };
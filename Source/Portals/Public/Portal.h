@@ -4,8 +4,13 @@
 
 #include "CoreMinimal.h"
 #include "GameFramework/Actor.h"
+#include "PortalRenderTargetPool.h"
 #include "Portal.generated.h"
 
+class APlayerController;
+class APortalManager;
+class UMaterialInstanceDynamic;
+class UMaterialInterface;
 class UPortalSceneCapture;
 class UTextureRenderTarget2D;
 
@@ -15,20 +20,92 @@ struct FTextureToRender {
    GENERATED_BODY()
 
 public:
-   FTextureToRender() : texture(nullptr), is_mirror(false), weight(0.f) {};
-   FTextureToRender(FTextureToRender&& other) noexcept;
-   FTextureToRender(const FTextureToRender& other) noexcept;
-   FTextureToRender& operator=(FTextureToRender&& other) noexcept;
-   FTextureToRender& operator=(const FTextureToRender& other) noexcept;
+   // Not owned, the textures belong to the SceneCaptures and the render target pool. Being UPROPERTYs, the GC still sees them
+   UPROPERTY(BlueprintReadOnly)
+   const UTexture* texture = nullptr;
+
+   UPROPERTY(BlueprintReadOnly)
+   bool is_mirror = false;
+
+   UPROPERTY(BlueprintReadOnly)
+   float weight = 0.f;
 
+   // Maps a world position on the portal surface to the clip space the texture was captured in
+   // Differs from the current view when the texture is reused from a previous frame, or only covers the part of the screen
+   // the portal is seen in (r.Portals.OffAxisProjection), so the material should sample with it rather than with the screen position
    UPROPERTY(BlueprintReadOnly)
-   const UTexture* texture;
+   FMatrix view_projection_matrix = FMatrix::Identity;
 
+   // With stereo rendering, texture and view_projection_matrix are the ones of the left eye
+   // Null otherwise, and in the captures, which are always rendered for a single eye
    UPROPERTY(BlueprintReadOnly)
-   bool is_mirror;
+   const UTexture* right_eye_texture = nullptr;
 
    UPROPERTY(BlueprintReadOnly)
-   float weight;
+   FMatrix right_eye_view_projection_matrix = FMatrix::Identity;
+};
+
+
+// Names of the material parameters set natively, built once from the PortalMaterial properties of the portal
+struct FPortalMaterialParameterNames
+{
+   // One per SceneCapture, the 5 ones a portal supports are stored inline. None if the material has no parameter for it
+   TArray<FName, TInlineAllocator<5>> textures;
+   TArray<FName, TInlineAllocator<5>> right_eye_textures;
+   TArray<FName, TInlineAllocator<5>> weights;
+
+   // The material flips all its textures at once
+   FName mirror;
+
+   FName view_projection_rows[4];
+   FName right_eye_view_projection_rows[4];
+};
+
+
+// Texture of a SceneCapture as the material of the portal displays it
+struct FPortalCaptureParameters
+{
+   const UTexture* texture = nullptr;
+
+   // The texture itself without stereo rendering
+   const UTexture* right_eye_texture = nullptr;
+
+   float weight = 0.f;
+   bool is_mirror = false;
+
+   bool operator==(const FPortalCaptureParameters& other) const
+   {
+      return texture == other.texture && right_eye_texture == other.right_eye_texture && weight == other.weight && is_mirror == other.is_mirror;
+   }
+};
+
+
+// Captures last blended into a composite texture, for it to only be blended again once one of them changed
+struct FPortalCompositeState
+{
+   const UTextureRenderTarget2D* target = nullptr;
+
+   TArray<FPortalCaptureParameters, TInlineAllocator<5>> captures;
+
+   // GetCaptureCount of every SceneCapture when they were blended
+   TArray<uint32, TInlineAllocator<5>> capture_counts;
+
+   float min_weight = 0.f;
+};
+
+
+// Parameters last set on a material of the portal, for only the ones that changed to be set again
+struct FPortalMaterialState
+{
+   // Material the parameters were set on, the state is reset when the view gets another one
+   const UMaterialInstanceDynamic* material = nullptr;
+
+   // One per texture already set on the material
+   TArray<FPortalCaptureParameters, TInlineAllocator<5>> captures;
+
+   FMatrix view_projection_matrix = FMatrix::Identity;
+   FMatrix right_eye_view_projection_matrix = FMatrix::Identity;
+   bool are_matrices_set = false;
 };
 
 
@@ -44,43 +121,73 @@ public:
 
    virtual void SetSceneCaptures() PURE_VIRTUAL(APortal::SetSceneCaptures,);
    
-   TArray<UPortalSceneCapture*> GetSceneCaptures() { return m_scene_captures; }
+   const TArray<UPortalSceneCapture*>& GetSceneCaptures() const { return m_scene_captures; }
 
-   // Check if the portal has been rendered but the "parent" portal has not captured it yet
-   // In that case, we want to keep its state and thus create a copy
-   bool IsRendererButNotCaptured() const { return m_is_renderer_but_not_captured; }
-   
-   void SetIsRendererButNotCaptured(bool is_renderer_but_not_captured) { m_is_renderer_but_not_captured = is_renderer_but_not_captured; }
+   // Make every SceneCapture render into (and the portal display) the given textures, one per SceneCapture
+   // view_projection_matrix is the one of the view the textures are captured from, passed to the material
+   // Textures of the right eye are reset, the captures only render one eye
+   void SetSceneCaptureRenderTargets(const TArray<UTextureRenderTarget2D*>& render_targets, const FMatrix& view_projection_matrix);
+
+   // Textures of the right eye the portal displays with stereo rendering, the SceneCapture textures being the ones of the left eye
+   void SetRightEyeRenderTargets(const TArray<UTextureRenderTarget2D*>& render_targets, const FMatrix& view_projection_matrix);
+
+   APortalManager* GetPortalManager() const { return m_portal_manager; }
+
+   void SetPortalManager(APortalManager* portal_manager) { m_portal_manager = portal_manager; }
 
-   // Get all 4 mesh vertices and compute the middle point and store them for quicker access
+   // Get the points used to test the visibility of the portal and compute the middle point and store them for quicker access
+   // These are the sockets of the mesh starting with "Visibility" if any, else the corners and center of its bounds,
+   // plus a grid of samples on the portal face if m_visibility_samples_per_side > 0
    void LoadMeshVertices() const;
 
+   // World space positions are only recomputed when the portal has moved since they were last asked for
    const TArray<FVector>* GetMeshVertices() const;
-   FVector GetMiddlePoint() const { return m_middle_point; }
+   FVector GetMiddlePoint() const;
+
+   FPlane GetPortalPlane() const;
+
+   bool IsMovable() const { return m_is_movable; }
+
+   EPortalRenderTargetFormat GetRenderTargetFormat() const { return m_render_target_format; }
 
    // --------------------------- //
 
-   FPlane GetPortalPlane() const { return FPlane(GetActorLocation(), GetActorForwardVector()); }
+   // Place all SceneCaptures of the portal given the watched actor, without capturing the scene
+   void UpdateCaptureViews(const FTransform& watched_actor_transform, const FMatrix& projection_matrix);
+
+   // Capture the scene with all SceneCaptures of the portal, from their current view, but the skipped ones and those IsSceneCaptureSkipped rejects
+   void CaptureScenes(unsigned int depth = 0, TConstArrayView<bool> skipped_scene_captures = TConstArrayView<bool>());
 
-   // Generate texture depending on visible portals (recursive)
-   void Render(const FTransform watched_actor_transform, const FMatrix& projection_matrix, unsigned int depth);
+   // SceneCaptures whose texture is not visible enough to be captured
+   virtual bool IsSceneCaptureSkipped(int32 scene_capture_index) const { return false; }
 
-   // Updates all SceneCaptures of the portal
-   void UpdateCaptures(const FTransform& watched_actor_transform, const FMatrix& projection_matrix);
+   // Number of SceneCaptures CaptureScenes renders, without the ones IsSceneCaptureSkipped rejects
+   int32 GetRenderedSceneCaptureCount() const;
 
-   // Gather textures generated by SceneCaptures and send them to BluePrint to be applied on the mesh
-   void UpdatePortalTexture();
+   // Fraction of the resolution the size of the portal on screen needs, for the textures of the SceneCaptures that are barely visible
+   virtual float GetSceneCaptureResolutionScale(int32 scene_capture_index) const { return 1.f; }
 
+   // Apply the textures generated by SceneCaptures on the material of the mesh, natively unless m_use_blueprint_textures is set
+   // For the other views than the first one, they are applied on the copy of the mesh only the player of the view sees
+   void UpdatePortalTexture(int32 view_index = 0);
+
+   // Create a copy of the mesh for every view but the first one, each only visible by its player, to display different textures per view
+   void SetViews(const TArray<APlayerController*>& view_controllers);
+
+   // From r.Portals.ActiveDistance, or the project settings if negative. The manager may render less far (see APortalManager::GetActivePortalDistance)
    UFUNCTION(BlueprintCallable)
-      static int GetActivePortalDistance() { return m_ACTIVE_PORTAL_DISTANCE; }
+      static int GetActivePortalDistance();
+
+   // From r.Portals.MaxRenderDepth, or the project settings if negative. The manager may render less deep (see APortalManager::GetMaxRenderDepth)
+   static unsigned int GetMaxRenderDepth();
 
    // -------- BP events -------- //
 
-   // Blueprint event that sets the material parameters to apply the textures passed as parameters
+   // Blueprint event that sets the material parameters to apply the textures passed as parameters, only called if m_use_blueprint_textures is set
    UFUNCTION(BlueprintImplementableEvent, Category = "Portal")
    void SetRTT(const TArray<FTextureToRender>& textures_to_render);
 
-   // Blueprint event that is called every tick
+   // Blueprint event that is called every tick, portals only tick if Start with Tick Enabled is set
    UFUNCTION(BlueprintImplementableEvent, Category = "Portal")
    void ForceTick();
 
@@ -88,6 +195,15 @@ public:
 protected:
    virtual void BeginPlay() override;
 
+   virtual void EndPlay(const EEndPlayReason::Type EndPlayReason) override;
+
+   virtual void OnConstruction(const FTransform& Transform) override;
+
+   // Transform the cached local space vertices, middle point and plane in world space
+   void UpdateWorldSpaceCache() const;
+
+   void OnPortalTransformUpdated(USceneComponent* updated_component, EUpdateTransformFlags update_transform_flags, ETeleportType teleport);
+
    UPortalSceneCapture* CreateDefaultSceneCapture();
 
    static void SetDefaultSceneCaptureParameters(UPortalSceneCapture* inout_scene_capture);
@@ -95,26 +211,131 @@ protected:
    UFUNCTION(BlueprintCallable)
    static bool IsPointInsideBox(FVector point, UBoxComponent* box);
 
+   // Corners and center of the bounds, and a samples_per_side x samples_per_side grid on its largest face
+   static void ComputeVisibilitySamples(const FBox& bounds, int32 samples_per_side, TArray<FVector>& OUT_samples);
+
+   UStaticMeshComponent* CreateViewMesh();
+
+   // Material the portal mesh was given, without the dynamic instance created over it
+   UMaterialInterface* GetBaseMaterial() const;
+
+   // Material displaying the textures of the view, the one of the portal mesh being made dynamic on first use
+   UMaterialInstanceDynamic* GetViewMaterial(int32 view_index);
+
+   // Textures of the SceneCaptures the material of the view displays, a single composited one if ShouldCompositeCaptures
+   void GatherCaptureParameters(int32 view_index, TArray<FPortalCaptureParameters, TInlineAllocator<5>>& OUT_captures);
+
+   // Blend the textures of the SceneCaptures into one before the material samples them, a texture per capture being too many for the material
+   virtual bool ShouldCompositeCaptures() const { return m_scene_captures.Num() > m_MAX_MATERIAL_TEXTURES; }
+
+   // Additive blend of the weighted captures into the composite texture of the view and eye, on the GPU
+   // The texture is only blended again when one of the captures changed or was captured again since the last blend
+   const UTexture* CompositeCaptures(int32 view_index, bool is_right_eye, const TArray<FPortalCaptureParameters, TInlineAllocator<5>>& captures);
+
+   // Captures weighing less than this fraction of the total are not blended, see r.Portals.Composite.MinWeight
+   static float GetMinCompositeWeight();
+
+   // Set the parameters the material of the view would get from SetRTT whose value changed, named after the PortalMaterial properties
+   void UpdateMaterialParameters(int32 view_index, const TArray<FPortalCaptureParameters, TInlineAllocator<5>>& captures);
+
+   // Build the names of the parameters of every SceneCapture if not done yet
+   void UpdateParameterNames();
+
+   // Set as 4 vector parameters, one per row
+   static void SetMatrixParameter(UMaterialInstanceDynamic* material, const FName (&row_names)[4], const FMatrix& matrix);
+
    // ------------------------------------- //
 
    UPROPERTY(VisibleAnywhere, Category = "Portal|Mesh")
    UStaticMeshComponent* m_portal_mesh;
 
+   // Extra points per side tested for visibility, for portals hidden by thin occluders. Ignored if the mesh has visibility sockets
+   UPROPERTY(EditAnywhere, Category = "Portal|Visibility", DisplayName = "Visibility samples per side", meta = (ClampMin = "0", ClampMax = "8"))
+   int32 m_visibility_samples_per_side = 0;
+
+   // Allows the portal to be moved during the game (on a moving platform for instance)
+   UPROPERTY(EditAnywhere, Category = "Portal", DisplayName = "Movable")
+   bool m_is_movable = false;
+
+   // Material parameters set natively, one per SceneCapture, named as in M_Portal
+   // The right eye textures are the same names with " right" appended
+   UPROPERTY(EditAnywhere, Category = "Portal|Material", DisplayName = "Texture parameters")
+   TArray<FName> m_texture_parameter_names = { TEXT("A"), TEXT("B"), TEXT("C"), TEXT("D"), TEXT("E") };
+
+   UPROPERTY(EditAnywhere, Category = "Portal|Material", DisplayName = "Weight parameters")
+   TArray<FName> m_weight_parameter_names = { TEXT("A weight"), TEXT("B weight"), TEXT("C weight"), TEXT("D weight"), TEXT("E weight") };
+
+   // Set from the first SceneCapture, the material mirrors all its textures or none
+   UPROPERTY(EditAnywhere, Category = "Portal|Material", DisplayName = "Mirror parameter")
+   FName m_mirror_parameter_name = TEXT("IsMirror");
+
+   // Set as 4 vector parameters, with Row0 to Row3 appended. Right is also appended for the right eye, as for the textures
+   UPROPERTY(EditAnywhere, Category = "Portal|Material", DisplayName = "View projection parameter")
+   FName m_view_projection_parameter_name = TEXT("ViewProjection");
+
+   // Call the SetRTT event for the first view instead of setting the material parameters natively, for materials set up in Blueprint
+   // The other views always set them natively
+   UPROPERTY(EditAnywhere, Category = "Portal|Material", DisplayName = "Set textures in Blueprint")
+   bool m_use_blueprint_textures = false;
+
+   // Dynamic instance of the material of the portal mesh, displaying the textures of the first view
+   UPROPERTY(Transient)
+   UMaterialInstanceDynamic* m_material = nullptr;
+
+   // Parameters set on the material of every view, the first one being m_material
+   TArray<FPortalMaterialState> m_material_states;
+
+   FPortalMaterialParameterNames m_parameter_names;
+
+   // Copies of the portal mesh for the views after the first one, with their materials
+   UPROPERTY(Transient)
+   TArray<UStaticMeshComponent*> m_view_meshes;
+
+   UPROPERTY(Transient)
+   TArray<UMaterialInstanceDynamic*> m_view_materials;
+
+   // Pixel format of the textures of the portal, see EPortalRenderTargetFormat for the quality and bandwidth of each
+   UPROPERTY(EditAnywhere, Category = "Portal|Rendering", DisplayName = "Render target format")
+   EPortalRenderTargetFormat m_render_target_format = EPortalRenderTargetFormat::Default;
+
    // Shortcuts to prevent loading every time, but mutable because it's just a shortcut
+   // Local ones are in the mesh space, and the world ones are updated from them when the portal moves
+   mutable TArray<FVector> m_local_vertices;
+   mutable FVector m_local_middle_point;
+
    mutable TArray<FVector> m_vertices;
    mutable FVector m_middle_point;
+   mutable FPlane m_portal_plane;
+   mutable bool m_is_world_space_cache_valid = false;
 
    UPROPERTY(BlueprintReadOnly)
    bool m_is_active;
 
-   // Scene captures linked to the portal. Maximum 5 supported
+   // Scene captures linked to the portal. Above m_MAX_MATERIAL_TEXTURES, they are composited into one texture
    TArray<UPortalSceneCapture*> m_scene_captures;
 
-private:
-   // If set to true, we need to make sure the textures generated by the SceneCaptures are not overwritten
-   bool m_is_renderer_but_not_captured;
+   // Composited textures of every view, for the left eye then the right one
+   UPROPERTY(Transient)
+   TArray<UTextureRenderTarget2D*> m_composite_render_targets;
+
+   // Same layout as m_composite_render_targets
+   TArray<FPortalCompositeState> m_composite_states;
+
+   // View projection the current textures of the SceneCaptures were captured with
+   FMatrix m_texture_view_projection_matrix = FMatrix::Identity;
 
-   static const unsigned int m_MAX_RENDER_DEPTH = 4;
+   // Empty without stereo rendering
+   TArray<UTextureRenderTarget2D*> m_right_eye_render_targets;
 
-   static const unsigned int m_ACTIVE_PORTAL_DISTANCE = 10000;
+   FMatrix m_right_eye_view_projection_matrix = FMatrix::Identity;
+
+   // Manager the portal is registered to
+   UPROPERTY(Transient)
+   APortalManager* m_portal_manager;
+
+   // Textures the portal material takes
+   static const int32 m_MAX_MATERIAL_TEXTURES = 5;
+
+private:
+   static constexpr const TCHAR* m_VISIBILITY_SOCKET_PREFIX = TEXT("Visibility");
 };
@@ -0,0 +1,51 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "WorldCollision.h"
+
+class APortal;
+class USceneComponent;
+
+
+// Occlusion test of the portals with asynchronous line traces
+// The traces submitted during a frame are read during the next one, so the results have one frame of latency
+class PORTALS_API FPortalAsyncVisibility
+{
+public:
+   // Get the occlusion result of the previous frame for this portal and camera, and submit the traces for the current one
+   // path_hash identifies where the camera is placed from (see FPortalRenderNode::path_hash)
+   // Returns true while no result is known yet, to never miss a portal
+   bool IsPortalVisible(APortal* portal, USceneComponent* camera, uint32 path_hash);
+
+   // Forget the results that have not been requested for a few frames
+   void RemoveStaleEntries();
+
+   void Reset() { m_entries.Reset(); }
+
+private:
+   // The same SceneCapture can look at a portal from several places in the same frame, one per node of its portal
+   using FKey = TTuple<const APortal*, const USceneComponent*, uint32>;
+
+   struct FEntry
+   {
+      // One per vertex, invalid if the vertex was already known to be hidden when submitting
+      TArray<FTraceHandle> trace_handles;
+
+      TArray<FVector> vertices;
+
+      uint64 submit_frame = 0;
+
+      bool is_visible = true;
+   };
+
+   // Returns false if the results are not available
+   static bool ReadTraces(UWorld* world, const FEntry& entry, bool& OUT_is_visible);
+
+   static void SubmitTraces(UWorld* world, APortal* portal, USceneComponent* camera, FEntry& OUT_entry);
+
+   // ------------------------------------- //
+
+   TMap<FKey, FEntry> m_entries;
+};
@@ -0,0 +1,143 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "GameFramework/Actor.h"
+#include "PortalBenchmark.generated.h"
+
+class APortal;
+class APortalCharacter;
+class ASimplePortal;
+class ATeleporterPortal;
+
+
+UENUM(BlueprintType)
+enum class EPortalBenchmarkScenario : uint8
+{
+   // Mirrors on a circle, all facing its center
+   FacingMirrors,
+   // Portals in a row, each one seen through the previous one
+   PortalChain,
+   // Grid of portals facing the camera path
+   ManyPortals,
+   // Pair of linked teleporters the player goes through back and forth
+   RapidTeleports
+};
+
+
+// One line of the benchmark results
+struct FPortalBenchmarkSample
+{
+   uint64 frame = 0;
+   float game_thread_ms = 0.f;
+   float gpu_ms = 0.f;
+   int32 nb_captures = 0;
+   int64 render_target_memory = 0;
+   uint64 used_physical_memory = 0;
+};
+
+
+// Spawns the portals of a scenario, moves the player along a scripted camera path and writes the frame timings to a CSV file
+// Can be placed in a level or spawned with the Portals.Benchmark console command
+UCLASS()
+class PORTALS_API APortalBenchmark : public AActor
+{
+   GENERATED_UCLASS_BODY()
+
+public:
+   void Tick(float DeltaSeconds) override;
+
+   void SetScenario(EPortalBenchmarkScenario scenario, int32 nb_portals);
+
+   void SetQuitWhenDone(bool quit_when_done) { m_quit_when_done = quit_when_done; }
+
+   // Path of the CSV file written at the end of the run
+   FString GetResultPath() const;
+
+protected:
+   void BeginPlay() override;
+   void EndPlay(const EEndPlayReason::Type EndPlayReason) override;
+
+private:
+   void SpawnScenario();
+
+   void SpawnFacingMirrors();
+   void SpawnPortalChain();
+   void SpawnManyPortals();
+   void SpawnRapidTeleports();
+
+   // Start the spawn of a portal, it is registered once FinishSpawning(FTransform::Identity, true) is called
+   template<class T>
+   T* BeginSpawnPortal(TSubclassOf<T> portal_class, const FVector& location, const FRotator& rotation);
+
+   // Class of the portals of the level, the C++ classes having no mesh
+   template<class T>
+   TSubclassOf<T> FindPortalClass(TSubclassOf<T> portal_class) const;
+
+   // Default camera path of the scenario, used if none is given
+   void ComputeDefaultCameraPath();
+
+   FTransform GetCameraPathTransform(float alpha) const;
+
+   void RecordSample();
+
+   // Destroy the spawned portals and give the player back its movement and transform, for the game to go on as before the run
+   void RestoreLevel();
+
+   void WriteResults() const;
+
+   // ------------------------------------- //
+
+   UPROPERTY(EditAnywhere, Category = "Benchmark", DisplayName = "Scenario")
+   EPortalBenchmarkScenario m_scenario = EPortalBenchmarkScenario::FacingMirrors;
+
+   // Mirrors, chain depth or total number of portals, depending on the scenario
+   UPROPERTY(EditAnywhere, Category = "Benchmark", DisplayName = "Number of portals", meta = (ClampMin = 1))
+   int32 m_nb_portals = 2;
+
+   UPROPERTY(EditAnywhere, Category = "Benchmark", DisplayName = "Distance between portals")
+   float m_portal_spacing = 600.f;
+
+   // Frames at the start of the run which are not recorded, for the render targets to be allocated
+   UPROPERTY(EditAnywhere, Category = "Benchmark", DisplayName = "Warmup frames", meta = (ClampMin = 0))
+   int32 m_nb_warmup_frames = 60;
+
+   // The path is followed frame by frame and not in time, so that every run renders the same images
+   UPROPERTY(EditAnywhere, Category = "Benchmark", DisplayName = "Recorded frames", meta = (ClampMin = 1))
+   int32 m_nb_frames = 1000;
+
+   UPROPERTY(EditAnywhere, Category = "Benchmark|If Scenario = RapidTeleports", DisplayName = "Frames between teleports", meta = (ClampMin = 1))
+   int32 m_teleport_interval = 5;
+
+   // Key points of the player camera, relative to the benchmark actor. Computed from the scenario if empty
+   UPROPERTY(EditAnywhere, Category = "Benchmark", DisplayName = "Camera path", meta = (MakeEditWidget))
+   TArray<FTransform> m_camera_path;
+
+   UPROPERTY(EditAnywhere, Category = "Benchmark", DisplayName = "Quit when done")
+   bool m_quit_when_done = false;
+
+   // Taken from the portals of the level if not set
+   UPROPERTY(EditAnywhere, Category = "Benchmark", DisplayName = "Simple portal class")
+   TSubclassOf<ASimplePortal> m_simple_portal_class;
+
+   UPROPERTY(EditAnywhere, Category = "Benchmark", DisplayName = "Teleporter portal class")
+   TSubclassOf<ATeleporterPortal> m_teleporter_portal_class;
+
+   UPROPERTY(Transient)
+   TArray<APortal*> m_spawned_portals;
+
+   TArray<FPortalBenchmarkSample> m_samples;
+
+   // Player moved along the camera path, and its state before the run
+   TWeakObjectPtr<APortalCharacter> m_character;
+   FTransform m_character_transform;
+   FRotator m_control_rotation;
+   TEnumAsByte<EMovementMode> m_movement_mode = MOVE_Walking;
+
+   FDateTime m_start_time;
+
+   int32 m_frame = 0;
+
+   bool m_is_done = false;
+};
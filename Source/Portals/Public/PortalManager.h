@@ -4,18 +4,187 @@
 
 #include "CoreMinimal.h"
 #include "GameFramework/Actor.h"
+#include "WorldPartition/WorldPartitionStreamingSource.h"
+#include "PortalAsyncVisibility.h"
 #include "PortalManager.generated.h"
 
 //Forward declaration
 class APlayerController;
 class APortal;
+class APortalRoomVolume;
 class ATeleporterPortal;
-class UPortalSceneCapture; 
+class UCameraComponent;
+class USceneComponent;
+class UPortalSceneCapture;
 class UTextureRenderTarget2D;
 struct FPostProcessSettings;
 
+
+// A portal to render, seen from a watched actor (the player camera or a SceneCapture of another portal)
+struct FPortalRenderNode
+{
+   APortal* portal = nullptr;
+
+   FTransform watched_actor_transform;
+
+   // Watched actor transform of each eye of the view, only the first one without stereo rendering
+   TArray<FTransform, TInlineAllocator<2>> eye_watched_actor_transforms;
+
+   // Part of the screen the capture of each eye renders, in normalized device coordinates, see r.Portals.OffAxisProjection
+   TArray<FBox2D, TInlineAllocator<2>> eye_capture_rects;
+
+   // Node through which the portal is seen, INDEX_NONE if the portal is directly visible
+   int32 parent = INDEX_NONE;
+
+   // Index of the SceneCapture of the parent through which the portal is seen
+   int32 parent_scene_capture = INDEX_NONE;
+
+   TArray<int32> children;
+
+   unsigned int depth = 0;
+
+   // Identifies the node across frames, from the portals and SceneCaptures it is seen through
+   // The same SceneCapture is placed differently for every node of its portal, so its visibility results are kept per node
+   uint32 path_hash = 0;
+
+   // Fraction of the player screen covered by the portal, through all its parents
+   float coverage = 0.f;
+
+   // Part of the player screen the portal is seen in, clipped by its parents, in normalized device coordinates
+   FBox2D screen_rect = FBox2D(ForceInit);
+
+   // False if the capture budget was exceeded, the last texture of the portal is then displayed
+   bool is_scheduled = false;
+
+   // Not captured this frame since its last texture is recent enough, see r.Portals.TemporalReuse
+   bool is_reused = false;
+
+   // Not captured this frame since another view captured the portal from the same place, its textures are used instead
+   bool is_shared = false;
+
+   // Textures the SceneCaptures of the portal render into for this node, the ones of every SceneCapture for the first eye, then for the second one
+   TArray<UTextureRenderTarget2D*> render_targets;
+
+   // Same layout as render_targets, true where the texture is the one of an identical capture of the frame, which is then not captured again
+   TArray<bool> is_capture_shared;
+};
+
+
+// Last capture of the textures owned by a portal
+struct FPortalTextureState
+{
+   // View projection of the watched actor for each eye, which maps the portal surface to texture coordinates
+   TArray<FMatrix, TInlineAllocator<2>> view_projection_matrices;
+
+   uint64 capture_frame = 0;
+};
+
+
+// Identifies the captures of a frame rendering the same image, their camera transforms being quantized by the sharing tolerance (see r.Portals.ShareCaptures)
+struct FPortalCaptureKey
+{
+   // Portal captured for a node, the linked portal for a SceneCapture
+   const UObject* portal = nullptr;
+
+   FIntVector location = FIntVector::ZeroValue;
+   FIntVector rotation = FIntVector::ZeroValue;
+
+   uint32 projection_hash = 0;
+
+   unsigned int depth = 0;
+
+   // Number of eyes for a node, type of the SceneCapture
+   int32 variant = 0;
+
+   bool operator==(const FPortalCaptureKey& other) const
+   {
+      return portal == other.portal && location == other.location && rotation == other.rotation && projection_hash == other.projection_hash
+             && depth == other.depth && variant == other.variant;
+   }
+
+   friend uint32 GetTypeHash(const FPortalCaptureKey& key)
+   {
+      uint32 hash = HashCombine(GetTypeHash(key.portal), GetTypeHash(key.location));
+      hash = HashCombine(hash, GetTypeHash(key.rotation));
+      hash = HashCombine(hash, key.projection_hash);
+
+      return HashCombine(hash, HashCombine(GetTypeHash(key.depth), GetTypeHash(key.variant)));
+   }
+};
+
+
+// Textures captured this frame, that identical captures of other views or other branches of a render tree display instead of capturing again
+struct FPortalSharedCapture
+{
+   // View and node that captured them. Captures being made children first, other nodes of the view can only display them in captures made after
+   int32 view_index = 0;
+   int32 node_index = INDEX_NONE;
+
+   // All the textures of the node, or the one of a single SceneCapture
+   TArray<UTextureRenderTarget2D*> render_targets;
+};
+
+
+// Portals tested together against the frustum of a camera, flattened per field for the worker threads to read them linearly
+struct FPortalVisibilityBatch
+{
+   TArray<FVector> locations;
+   TArray<FVector> normals;
+   TArray<FVector> bounds_origins;
+   TArray<FVector> bounds_extents;
+
+   // Result of the frustum test of every portal
+   TArray<uint8> is_in_view;
+};
+
+
+// Linked portal a player can see the surroundings of through a chain of portals
+struct FPortalDestination
+{
+   // Weak since the destinations are kept between updates, the portal may be destroyed in between
+   TWeakObjectPtr<const APortal> portal;
+
+   // Virtual camera the destination is seen from, the SceneCapture in front of the linked portal
+   FTransform camera_transform;
+
+   // Number of portals between the player and the destination, 1 for a portal seen directly
+   int32 nb_hops = 0;
+};
+
+
+// Portals seen by a local player, split-screen having one view per player
+struct FPortalView
+{
+   TWeakObjectPtr<APlayerController> controller;
+
+   // The first view displays its textures on the portal meshes, the others on copies only their player sees
+   int32 index = 0;
+
+   // Size in pixels of the part of the screen each eye of the view is rendered in
+   FVector2D viewport_size = FVector2D(1920.f, 1080.f);
+
+   // Player camera of each eye, only one without stereo rendering. The render tree is built from the center of the eyes
+   TArray<FTransform, TInlineAllocator<2>> eye_transforms;
+   TArray<FMatrix, TInlineAllocator<2>> eye_projection_matrices;
+
+   // Parents are always stored before their children
+   TArray<FPortalRenderNode> render_nodes;
+
+   // Camera the render tree was built from, to reuse it on the next frames if it doesn't move
+   FTransform render_tree_camera_transform;
+   FMatrix render_tree_projection_matrix = FMatrix::Identity;
+   int32 render_tree_age = 0;
+   bool is_render_tree_valid = false;
+
+   TMap<const APortal*, FPortalTextureState> portal_texture_states;
+
+   // Textures owned by the portals in the views after the first one, leased from the pool. The first view uses the SceneCapture ones
+   TMap<const APortal*, TArray<UTextureRenderTarget2D*>> portal_render_targets;
+};
+
+
 UCLASS()
-class PORTALS_API APortalManager : public AActor
+class PORTALS_API APortalManager : public AActor, public IWorldPartitionStreamingSourceProvider
 {
    GENERATED_UCLASS_BODY()
 
@@ -23,27 +192,241 @@ public:
    APortalManager();
 
    void Init();
-   void Tick(float DeltaSeconds) override;
+
+   // Teleport the actors crossing portals and render the visible portals, called once per frame by the UPortalWorldSubsystem
+   void Update(float DeltaSeconds);
 
    // Called by a Portal actor when wanting to teleport something
    UFUNCTION(BlueprintCallable, Category = "Portal")
-   void RequestTeleportByPortal(ATeleporterPortal* portal, AActor* target_to_teleport) const;
+   void RequestTeleportByPortal(ATeleporterPortal* portal, AActor* target_to_teleport);
+
+   // Forget the render state of the views of the actor if it is a player, the next render being done from its new location
+   void NotifyActorTeleported(const AActor* actor);
+
+   // ---- Portal registry ---- //
+
+   // Add a portal to the managed ones and create its SceneCaptures
+   void RegisterPortal(APortal* portal);
+
+   void UnregisterPortal(APortal* portal);
+
+   // Force the visibility graph to be rebuilt before the next render (link changed, portal added...)
+   void MarkVisibilityGraphDirty() { m_is_visibility_graph_dirty = true; }
+
+   // Only update what the portal changes in the visibility graph before the next render
+   void NotifyPortalMoved(APortal* portal);
+
+   // ---- Rooms ---- //
+
+   void RegisterRoom(APortalRoomVolume* room);
+
+   void UnregisterRoom(APortalRoomVolume* room) { m_rooms.Remove(room); }
+
+   // Rooms containing the location, in which a SceneCapture looking from it only renders their actors
+   void GetRoomsAt(const FVector& location, TArray<APortalRoomVolume*>& OUT_rooms) const;
+
+   // Portals that can ever be seen through the given SceneCapture
+   const TArray<APortal*>& GetVisibilityCandidates(const UPortalSceneCapture* scene_capture) const;
+
+   // Number of SceneCapture renders queued by the last update of the visible portals, over all the views
+   int32 GetCaptureCount() const { return m_capture_count; }
+
+   // ---- Governor ---- //
+
+   // APortal::GetMaxRenderDepth lowered by the governor while the GPU frame time is above its target
+   unsigned int GetMaxRenderDepth() const;
+
+   // APortal::GetActivePortalDistance lowered by the governor while the GPU frame time is above its target
+   float GetActivePortalDistance() const;
+
+   // 0 while the GPU frame time is under the target, up to the max level of the project settings
+   int32 GetGovernorLevel() const { return m_governor_level; }
+
+   // ---- Streaming ---- //
+
+   // Linked portals the players can see through at most max_hops portals, each at most the active distance away from the previous one
+   // Only the portals facing away are skipped, the destinations of the ones out of the frustum being needed as soon as the player turns
+   void GetReachableDestinations(int32 max_hops, TArray<FPortalDestination>& OUT_destinations) const;
+
+   // Destinations streamed in at the last update (see r.Portals.Streaming)
+   const TArray<FPortalDestination>& GetStreamingDestinations() const { return m_streaming_destinations; }
+
+   // World Partition source loading the cells around the virtual cameras of the destinations
+   virtual bool GetStreamingSource(FWorldPartitionStreamingSource& OutStreamingSource) override;
 
 private:
+   // Teleport the actors which went through a teleporter since the last tick, all teleporters being tested before any teleport
+   void UpdateCrossings();
+
    // Look for directly visible portals and call their render method
-   void UpdateVisiblePortals() const;
+   void UpdateVisiblePortals();
+
+   // Raise the governor level if the GPU frame time is above the target, lower it if there is headroom, like the dynamic resolution does
+   void UpdateGovernor();
+
+   // Gather the destinations to stream in and add their virtual cameras to the texture and mesh streaming views
+   void UpdateStreaming();
 
    void ClearAllPortals() const;
 
-   FMatrix GetCameraProjectionMatrix() const;
+   static FMatrix GetCameraProjectionMatrix(const APlayerController* controller);
 
-   // ------------------------------------- //
+   // Size of the part of the screen given to the player, smaller than the viewport in split-screen
+   static FVector2D GetViewSize(const APlayerController* controller);
+
+   // ---- Views ---- //
+
+   // Create a view for every local player, and give the portals a mesh for each of them
+   void UpdateViews();
+
+   // Give back to the pool the textures the portals own in the view
+   void ReleaseViewRenderTargets(FPortalView& view) const;
+
+   // Build or refresh the render tree of the view from its player camera, and render it
+   void RenderView(FPortalView& view, int32& inout_resize_budget);
+
+   // Cameras of the eyes of the player with stereo rendering (see r.Portals.Stereo), else the player camera itself
+   static void UpdateEyes(FPortalView& view, const FTransform& camera_transform, const FMatrix& projection_matrix);
+
+   // Place the watched actor of every eye in every node, the nodes themselves being shared by the eyes, and fit their captures to the portals
+   static void UpdateEyeTransforms(FPortalView& view);
+
+   // ---- Render scheduling ---- //
+
+   // Expand the tree of visible portals breadth-first, most visible portals first, until the capture budget is spent
+   void BuildRenderTree(FPortalView& view, UCameraComponent* camera, const FMatrix& projection_matrix);
+
+   // Add a node for every portal visible through the SceneCaptures of the given node
+   void ExpandRenderNode(FPortalView& view, int32 node_index, const FMatrix& projection_matrix);
+
+   static void AddRenderNode(FPortalView& view, APortal* portal, const FTransform& watched_actor_transform, int32 parent, int32 parent_scene_capture, unsigned int depth, float coverage, const FBox2D& screen_rect);
+
+   // Check if the camera moved little enough since the render tree of the view was built to reuse it
+   static bool CanReuseRenderTree(const FPortalView& view, const FTransform& camera_transform, const FMatrix& projection_matrix);
+
+   // Update the watched actor transforms of the nodes of the last render tree for the new camera transform, without visibility test
+   static void RefreshRenderTree(FPortalView& view, const FTransform& camera_transform, const FMatrix& projection_matrix);
+
+   // Capture every scheduled node for every eye, children first, and apply the resulting textures
+   void RenderTree(FPortalView& view, const FMatrix& projection_matrix, int32& inout_resize_budget);
+
+   // Textures owned by the portal of the node in the view that are not the SceneCapture ones, leased again if the node needs another size
+   TArray<UTextureRenderTarget2D*>& UpdateViewRenderTargets(FPortalView& view, const FPortalRenderNode& node, int32 nb_textures, bool can_resize, int32& inout_resize_budget) const;
+
+   // Capture of the current frame made from the same place as the node, by another view or another node
+   const FPortalSharedCapture* FindSharedCapture(const FPortalView& view, const FPortalRenderNode& node) const;
+
+   // Make the SceneCaptures of the node identical to one captured earlier in the frame display its texture, the others being shared in turn
+   // The node is shared as a whole if all of them are
+   void ShareSceneCaptures(FPortalView& view, int32 node_index);
+
+   // Check if the shared capture is rendered before the capture the node is displayed in
+   static bool CanDisplaySharedCapture(const FPortalView& view, const FPortalRenderNode& node, const FPortalSharedCapture& shared_capture);
+
+   static FPortalCaptureKey MakeCaptureKey(const UObject* portal, const FTransform& transform, const FMatrix& projection_matrix, unsigned int depth, int32 variant);
+
+   static FPortalCaptureKey MakeNodeCaptureKey(const FPortalView& view, const FPortalRenderNode& node);
+
+   // Textures of the node the given eye is captured in
+   static TArray<UTextureRenderTarget2D*> GetEyeRenderTargets(const FPortalView& view, const FPortalRenderNode& node, int32 eye_index);
 
-   UPROPERTY()
-   APlayerController* m_controller;
+   // Check if the own textures of the portal were captured recently enough for the node not to be captured this frame
+   static bool CanReuseLastTexture(const FPortalView& view, const FPortalRenderNode& node);
+
+   // Number of frames between two captures of the node, 1 to capture it every frame
+   static int32 GetCaptureInterval(const FPortalRenderNode& node);
+
+   // Projection of the eye cropped to the part of the screen the node is captured for
+   static FMatrix GetCaptureProjectionMatrix(const FPortalView& view, const FPortalRenderNode& node, int32 eye_index);
+
+   // Maps the portal surface to the texture coordinates of the capture of the node
+   static FMatrix GetViewProjectionMatrix(const FPortalView& view, const FPortalRenderNode& node, int32 eye_index);
+
+   // View projection the own textures of the portal were last captured with for the eye, default_matrix if never captured
+   static FMatrix GetTextureViewProjectionMatrix(const FPortalView& view, const APortal* portal, int32 eye_index, const FMatrix& default_matrix);
+
+   // View projection of the textures a node owning the portal textures displays, which may be shared with another view
+   static FMatrix GetOwnTextureViewProjectionMatrix(const FPortalView& view, const FPortalRenderNode& own_node, int32 eye_index, const FMatrix& default_matrix);
+
+   // Estimated GPU time in ms needed to capture the SceneCaptures of the portal it renders
+   static float EstimateCaptureCost(const APortal* portal);
+
+   // Visibility test of the candidates from a camera, whose frustum is built once. The frustum tests run in parallel (see r.Portals.ParallelVisibility)
+   // and the occlusion ones on the game thread, asynchronous if r.Portals.AsyncVisibilityTraces is set
+   // path_hash is the one of the node the camera belongs to, 0 for the player camera
+   void ComputeVisiblePortals(const TArray<APortal*>& candidates, USceneComponent* camera, uint32 path_hash, float near_plane_distance, TArray<APortal*>& OUT_visible_portals);
+
+   // ---- Visibility graph ---- //
+
+   void RebuildVisibilityGraph();
+
+   // Incremental update of the visibility graph for the portals that moved since the last render
+   void UpdateMovedPortals();
+
+   // Store in out_candidates every portal that may be visible through the SceneCapture
+   void ComputeVisibilityCandidates(const UPortalSceneCapture* scene_capture, TArray<APortal*>& out_candidates) const;
+
+   bool IsVisibilityCandidate(const UPortalSceneCapture* scene_capture, const APortal* portal) const;
+
+   // Gather the registered portals located less than range away from location
+   void GatherPortalsInRange(const FVector& location, float range, TArray<APortal*>& out_portals) const;
+
+   FIntVector GetGridCell(const FVector& location) const;
+
+   // ------------------------------------- //
 
    UPortalSceneCapture* m_scene_capture_template;
 
+   UPROPERTY(Transient)
+   TArray<APortal*> m_portals;
+
+   // Registered portals which can teleport, tested for crossings every tick
+   UPROPERTY(Transient)
+   TArray<ATeleporterPortal*> m_teleporters;
+
+   UPROPERTY(Transient)
+   TArray<APortalRoomVolume*> m_rooms;
+
+   // Uniform grid of the registered portals, cells are m_grid_cell_size wide
+   TMap<FIntVector, TArray<APortal*>> m_portal_grid;
+
+   TMap<const APortal*, FIntVector> m_portal_cells;
+
+   TSet<APortal*> m_moved_portals;
+
+   TMap<const UPortalSceneCapture*, TArray<APortal*>> m_visibility_candidates;
+
+   // One per local player, in the order of their controllers
+   TArray<FPortalView> m_views;
+
+   // Captures of the current frame, of whole nodes and of single SceneCaptures
+   TMap<FPortalCaptureKey, FPortalSharedCapture> m_shared_captures;
+   TMap<FPortalCaptureKey, FPortalSharedCapture> m_shared_scene_captures;
+
+   // Temporary textures of the current frame, released once every view is rendered since the other views may display them
+   TArray<UTextureRenderTarget2D*> m_leased_render_targets;
+
+   FPortalAsyncVisibility m_async_visibility;
+
+   // Kept between the visibility tests to reuse its allocations
+   FPortalVisibilityBatch m_visibility_batch;
+
+   float m_grid_cell_size = 1.f;
+
+   int32 m_capture_count = 0;
+
+   // Average of the last GPU frame times in ms
+   float m_smoothed_gpu_time = 0.f;
+
+   int32 m_governor_level = 0;
+
+   int32 m_frames_since_governor_change = 0;
+
+   TArray<FPortalDestination> m_streaming_destinations;
+
+   bool m_is_visibility_graph_dirty = true;
+
 protected:
    void BeginPlay() override;
+   void EndPlay(const EEndPlayReason::Type EndPlayReason) override;
 };
@@ -0,0 +1,129 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Engine/DeveloperSettings.h"
+#include "PortalQualitySettings.generated.h"
+
+
+// Rendering features of a portal capture
+USTRUCT()
+struct FPortalCaptureQualityTier
+{
+   GENERATED_BODY()
+
+   // 0 disables ambient occlusion
+   UPROPERTY(EditAnywhere, Category = "Quality", DisplayName = "Ambient occlusion quality", meta = (ClampMin = "0", ClampMax = "100"))
+   float ambient_occlusion_quality = 100.f;
+
+   // 0 disables screen space reflections
+   UPROPERTY(EditAnywhere, Category = "Quality", DisplayName = "Screen space reflection quality", meta = (ClampMin = "0", ClampMax = "100"))
+   float screen_space_reflection_quality = 50.f;
+
+   UPROPERTY(EditAnywhere, Category = "Quality", DisplayName = "Dynamic shadows")
+   bool dynamic_shadows = true;
+
+   UPROPERTY(EditAnywhere, Category = "Quality", DisplayName = "Particles")
+   bool particles = true;
+
+   UPROPERTY(EditAnywhere, Category = "Quality", DisplayName = "Translucency")
+   bool translucency = true;
+
+   UPROPERTY(EditAnywhere, Category = "Quality", DisplayName = "Fog")
+   bool fog = true;
+
+   // Higher values select lower mesh LODs
+   UPROPERTY(EditAnywhere, Category = "Quality", DisplayName = "LOD distance factor", meta = (ClampMin = "0.1"))
+   float lod_distance_factor = 3.f;
+
+   // Number of portals that can be seen through each other when rendering from this tier
+   UPROPERTY(EditAnywhere, Category = "Quality", DisplayName = "Max render depth", meta = (ClampMin = "0"))
+   int32 max_render_depth = 4;
+};
+
+
+// Quality of the portal captures, per level of a scalability group (Project Settings > Plugins > Portal Quality)
+UCLASS(Config = Game, DefaultConfig, meta = (DisplayName = "Portal Quality"))
+class PORTALS_API UPortalQualitySettings : public UDeveloperSettings
+{
+   GENERATED_BODY()
+
+public:
+   UPortalQualitySettings();
+
+   // Tier of a capture at the given recursion depth, 0 being the portals seen directly
+   const FPortalCaptureQualityTier& GetTier(unsigned int depth) const;
+
+   virtual FName GetCategoryName() const override { return TEXT("Plugins"); }
+
+   int32 GetMaxRenderDepth() const { return m_max_render_depth; }
+
+   int32 GetActivePortalDistance() const { return m_active_portal_distance; }
+
+   float GetEmbeddedPortalDistance() const { return m_embedded_portal_distance; }
+
+   // GPU frame time in ms the portal governor keeps under, 0 if disabled
+   float GetGovernorTargetGPUTime() const { return m_governor_target_gpu_time; }
+
+   // Fraction of the target the GPU frame time must go below for the governor to restore a level
+   float GetGovernorHeadroom() const { return m_governor_headroom; }
+
+   int32 GetGovernorMaxLevel() const { return m_governor_max_level; }
+
+   int32 GetGovernorMinRenderDepth() const { return m_governor_min_render_depth; }
+
+   float GetGovernorMinDistanceFraction() const { return m_governor_min_distance_fraction; }
+
+   int32 GetGovernorFramesBetweenChanges() const { return m_governor_frames_between_changes; }
+
+private:
+   int32 GetTierIndex(unsigned int depth) const;
+
+   // ------------------------------------- //
+
+   // One tier per level of the scalability group, from the lowest. Levels above the last tier use the last one
+   UPROPERTY(Config, EditAnywhere, Category = "Quality", DisplayName = "Tiers")
+   TArray<FPortalCaptureQualityTier> m_tiers;
+
+   // Console variable whose value selects the tier of the portals seen directly
+   UPROPERTY(Config, EditAnywhere, Category = "Quality", DisplayName = "Scalability group")
+   FString m_scalability_group = TEXT("sg.PostProcessQuality");
+
+   // A portal seen through another one uses a lower tier
+   UPROPERTY(Config, EditAnywhere, Category = "Quality", DisplayName = "Tiers dropped per recursion level", meta = (ClampMin = "0"))
+   int32 m_tiers_dropped_per_depth = 1;
+
+   // Number of portals that can be seen through each other, overridden by r.Portals.MaxRenderDepth
+   UPROPERTY(Config, EditAnywhere, Category = "Limits", DisplayName = "Max render depth", meta = (ClampMin = "0"))
+   int32 m_max_render_depth = 4;
+
+   // Portals further than this from the camera are never rendered, overridden by r.Portals.ActiveDistance
+   UPROPERTY(Config, EditAnywhere, Category = "Limits", DisplayName = "Active portal distance", meta = (ClampMin = "1"))
+   int32 m_active_portal_distance = 10000;
+
+   // A vertex hidden by an impact closer than this is considered embedded in a wall, overridden by r.Portals.EmbeddedDistance
+   UPROPERTY(Config, EditAnywhere, Category = "Limits", DisplayName = "Embedded portal distance", meta = (ClampMin = "0"))
+   float m_embedded_portal_distance = 150.f;
+
+   // The render depth and the active distance are lowered while the GPU frame time is above it, 0 to disable. Overridden by r.Portals.Governor.TargetGPUTime
+   UPROPERTY(Config, EditAnywhere, Category = "Governor", DisplayName = "Target GPU frame time (ms)", meta = (ClampMin = "0"))
+   float m_governor_target_gpu_time = 0.f;
+
+   UPROPERTY(Config, EditAnywhere, Category = "Governor", DisplayName = "Headroom to restore", meta = (ClampMin = "0", ClampMax = "1"))
+   float m_governor_headroom = 0.85f;
+
+   // Each level lowers the render depth by one and the active distance by a step towards its minimum
+   UPROPERTY(Config, EditAnywhere, Category = "Governor", DisplayName = "Max level", meta = (ClampMin = "0"))
+   int32 m_governor_max_level = 3;
+
+   UPROPERTY(Config, EditAnywhere, Category = "Governor", DisplayName = "Min render depth", meta = (ClampMin = "0"))
+   int32 m_governor_min_render_depth = 1;
+
+   UPROPERTY(Config, EditAnywhere, Category = "Governor", DisplayName = "Min active distance fraction", meta = (ClampMin = "0.05", ClampMax = "1"))
+   float m_governor_min_distance_fraction = 0.5f;
+
+   // Lets the GPU time settle after a change before the next one
+   UPROPERTY(Config, EditAnywhere, Category = "Governor", DisplayName = "Frames between changes", meta = (ClampMin = "1"))
+   int32 m_governor_frames_between_changes = 30;
+};
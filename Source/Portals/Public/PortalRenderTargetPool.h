@@ -0,0 +1,92 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Subsystems/WorldSubsystem.h"
+#include "Engine/TextureRenderTarget2D.h"
+#include "PortalRenderTargetPool.generated.h"
+
+
+// Pixel formats of the portal render targets. The captures are HDR scene color, their alpha is never used
+UENUM(BlueprintType)
+enum class EPortalRenderTargetFormat : uint8
+{
+   // Project format, set by r.Portals.RenderTarget.Format
+   Default,
+   // 8 bytes per pixel, full HDR range. Best quality, twice the memory and bandwidth of the others
+   RGBA16f,
+   // 4 bytes per pixel, HDR range with less color precision. Usually the best tradeoff
+   R11G11B10f,
+   // 4 bytes per pixel, 10 bits per color clamped to [0;1], highlights are lost
+   RGB10A2,
+   // 4 bytes per pixel, 8 bits per color clamped to [0;1], highlights are lost and dark gradients band
+   RGBA8
+};
+
+
+// Free render targets sharing the same size and format
+USTRUCT()
+struct FPortalRenderTargetBucket
+{
+   GENERATED_BODY()
+
+   UPROPERTY()
+   TArray<UTextureRenderTarget2D*> render_targets;
+
+   // Frame each render target was released on, at the same index. The oldest ones come first
+   TArray<uint64> release_frames;
+};
+
+
+// Recycles the render targets used by the portals instead of allocating new ones every time one is needed
+UCLASS()
+class PORTALS_API UPortalRenderTargetPool : public UWorldSubsystem
+{
+   GENERATED_BODY()
+
+public:
+   // Get a render target of the given size and format, a new one is only allocated if none is free
+   UTextureRenderTarget2D* LeaseRenderTarget(int32 size_x, int32 size_y, EPortalRenderTargetFormat format);
+
+   // Give back a leased render target so that it can be reused
+   void ReleaseRenderTarget(UTextureRenderTarget2D* render_target);
+
+   // Free the render targets left unused for too long, then the oldest ones while over the free memory budget
+   // See r.Portals.Pool.MaxIdleFrames and r.Portals.Pool.MaxFreeMemory, called once per frame by the manager
+   void TrimFreeRenderTargets();
+
+   virtual void Deinitialize() override;
+
+   // Format a render target of the pool has been created with
+   static EPortalRenderTargetFormat GetFormat(const UTextureRenderTarget2D* render_target);
+
+   // GPU memory in bytes of every render target allocated by the pool and not freed yet, leased or free
+   int64 GetRenderTargetMemory() const { return m_render_target_memory; }
+
+protected:
+   virtual bool DoesSupportWorldType(EWorldType::Type world_type) const override;
+
+private:
+   static FIntVector GetBucketKey(int32 size_x, int32 size_y, EPortalRenderTargetFormat format);
+
+   UTextureRenderTarget2D* CreateRenderTarget(int32 size_x, int32 size_y, EPortalRenderTargetFormat format);
+
+   static int64 GetMemory(const UTextureRenderTarget2D* render_target);
+
+   // Remove the free render target from the memory stats and let the GC collect it
+   void FreeRenderTarget(UTextureRenderTarget2D* render_target);
+
+   // ------------------------------------- //
+
+   UPROPERTY()
+   TMap<FIntVector, FPortalRenderTargetBucket> m_free_render_targets;
+
+   UPROPERTY()
+   TSet<UTextureRenderTarget2D*> m_leased_render_targets;
+
+   int64 m_render_target_memory = 0;
+
+   // Part of m_render_target_memory in the free render targets, to remove them from the stats
+   int64 m_free_render_target_memory = 0;
+};
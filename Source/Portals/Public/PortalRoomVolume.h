@@ -0,0 +1,48 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "GameFramework/Volume.h"
+#include "PortalRoomVolume.generated.h"
+
+
+// Part of the level seen through the portals placed in it
+// The SceneCaptures looking into a room only render the actors inside it (see r.Portals.RoomCulling), instead of the whole world
+UCLASS(Blueprintable)
+class PORTALS_API APortalRoomVolume : public AVolume
+{
+   GENERATED_UCLASS_BODY()
+
+public:
+   // Add the actors a capture looking into the room has to render
+   void GetVisibleActors(TArray<AActor*>& OUT_actors) const;
+
+   // Changes every time an actor enters or leaves the room
+   uint32 GetRevision() const { return m_revision; }
+
+protected:
+   void BeginPlay() override;
+   void EndPlay(const EEndPlayReason::Type EndPlayReason) override;
+
+private:
+   // Actors whose bounds are in the room when the game starts, static ones never sending overlap events
+   void GatherActors();
+
+   UFUNCTION()
+   void OnActorEntered(AActor* overlapped_actor, AActor* other_actor);
+
+   UFUNCTION()
+   void OnActorLeft(AActor* overlapped_actor, AActor* other_actor);
+
+   // ------------------------------------- //
+
+   // Actors outside the volume still seen from inside, like the sky or the scenery behind a window
+   UPROPERTY(EditAnywhere, Category = "Portal Room", DisplayName = "Also visible")
+   TArray<AActor*> m_extra_actors;
+
+   UPROPERTY(Transient)
+   TArray<AActor*> m_actors;
+
+   uint32 m_revision = 0;
+};
@@ -4,11 +4,13 @@
 
 #include "CoreMinimal.h"
 #include "Components/SceneCaptureComponent2D.h"
+#include "PortalRenderTargetPool.h"
 #include "PortalSceneCapture.generated.h"
 
 class APortal;
 class USceneComponent;
 class UTextureRenderTarget2D;
+struct FPortalCaptureQualityTier;
 
 
 UENUM()
@@ -23,9 +25,46 @@ class PORTALS_API UPortalSceneCapture : public USceneCaptureComponent2D
 public:
    void Init(ECameraType type, APortal* linked_portal, bool exit_in_front = false, float weight = 1.f);
 
+   // Update the view and capture the scene
    void Update(const FTransform& watched_actor_transfo, const FMatrix& projection_matrix);
 
-   void UpdateRenderTarget();
+   // Only place the SceneCapture and its clip plane given the watched actor, without capturing anything
+   void UpdateView(const FTransform& watched_actor_transfo, const FMatrix& projection_matrix);
+
+   // Render the scene from the current view into the render target
+   void Capture();
+
+   // Number of scenes captured so far, for the textures made from the capture target to know when it changed
+   uint32 GetCaptureCount() const noexcept { return m_capture_count; }
+
+   // Set the post-process and show flags of the next captures
+   void ApplyQualityTier(const FPortalCaptureQualityTier& quality_tier);
+
+   // Resize the render target for the portal to be seen in screen_rect (normalized device coordinates) at the given recursion depth
+   // by a view of viewport_size pixels
+   // A new size is only requested out of the hysteresis band of the current one, and if inout_resize_budget allows it
+   // The new texture replaces the current one on the next call, once it has been created
+   void UpdateRenderTarget(const FBox2D& screen_rect, unsigned int depth, const FVector2D& viewport_size, int32& inout_resize_budget);
+
+   // Size of the render target needed for a portal seen in screen_rect at the given recursion depth, rounded to a power of two on each axis and clamped to the viewport
+   // With r.Portals.OffAxisProjection, each axis follows the projected extent of the portal on it. Deeper levels get lower resolutions
+   static FIntPoint CalculateRenderSize(const FBox2D& screen_rect, unsigned int depth, const FVector2D& viewport_size);
+
+   // Check if render_target is too far from the size needed in screen_rect, or of another format, to keep being used
+   static bool NeedsNewRenderTarget(const UTextureRenderTarget2D* render_target, const FBox2D& screen_rect, unsigned int depth, const FVector2D& viewport_size, EPortalRenderTargetFormat format);
+
+   // Size of the whole game viewport, 1920x1080 if there is none
+   static FVector2D GetGameViewportSize();
+
+   // See r.Portals.OffAxisProjection
+   static bool IsOffAxisProjectionEnabled();
+
+   // Part of the screen a capture of the portal seen from the watched actor has to render, in normalized device coordinates
+   // The whole screen if r.Portals.OffAxisProjection is not set
+   static FBox2D ComputeCaptureRect(const APortal* portal, const FTransform& watched_actor_transform, const FMatrix& projection_matrix);
+
+   // Format of the render targets of the portal at the given recursion depth, from its settings and the project ones
+   static EPortalRenderTargetFormat GetRenderTargetFormat(const APortal* portal, unsigned int depth);
 
    // ---- Getters & Setters ---- //
 
@@ -37,6 +76,11 @@ public:
    UFUNCTION(BlueprintPure, Category = "Portal")
    const ECameraType getType() const noexcept { return m_is_total_reflection ? ECameraType::Mirror : m_type; }
 
+   // Returns the "true" type of the camera, not influenced by total reflection for instance
+   ECameraType GetTrueType() const noexcept { return m_type; }
+
+   bool HasRefraction() const noexcept { return m_refractive_ind_1 != m_refractive_ind_2; }
+
    float getWeight() const noexcept { return m_weight; }
 
    bool IsExitInFront() const noexcept { return m_exit_in_front; }
@@ -47,6 +91,11 @@ public:
    
    void SetRenderTarget(UTextureRenderTarget2D* new_render_target) { m_render_target = new_render_target; TextureTarget = m_render_target; }
 
+   // Texture the next captures render into, the render target of the SceneCapture unless the portal is seen by several nodes or views
+   UTextureRenderTarget2D* GetCaptureTarget() const { return TextureTarget; }
+
+   void SetCaptureTarget(UTextureRenderTarget2D* capture_target) { TextureTarget = capture_target; }
+
    //Target of where the portal is looking
    UFUNCTION(BlueprintPure, Category = "Portal")
    APortal* GetLinkedPortal() { return m_linked_portal; }
@@ -54,21 +103,20 @@ public:
    const APortal* GetLinkedPortal() const { return m_linked_portal; }
    
    UFUNCTION(BlueprintCallable, Category = "Portal")
-   void SetLinkedPortal(APortal* new_portal) { m_linked_portal = new_portal; }
+   void SetLinkedPortal(APortal* new_portal);
 
    // --------------------------- //
 
 protected:
    virtual void BeginPlay() override;
 
+   virtual void EndPlay(const EEndPlayReason::Type EndPlayReason) override;
+
    // If the owner is correct, set it
    bool SetOwnerIfAvailable();
    // Check if the owner has been set, else set it if possible
    bool IsOwnerValid();
 
-   // Returns the "true" type of the camera, not influenced by total reflection for instance
-   ECameraType GetTrueType() const noexcept { return m_type; }
-
    // Used to update the transformation of the camera given the one of the watched actor
    // Can be overwritten in Blueprint
    UFUNCTION(BlueprintNativeEvent, BlueprintCallable, Category = "Portal")
@@ -79,10 +127,23 @@ protected:
    UFUNCTION(BlueprintNativeEvent, BlueprintCallable, Category = "Portal")
    void UpdateNearClipPlane();
 
-   int32 CalculateRenderSize(float Distance) const;
-
    void GenerateDefaultTexture();
 
+   // Replace the clip plane by an oblique near plane in the projection if r.Portals.ObliqueNearPlane allows it
+   void UpdateObliqueNearPlane();
+
+   // Only render the actors of the rooms the SceneCapture looks into, if any
+   void UpdateRoomCulling();
+
+   // Exact size needed, before rounding
+   static FVector2D CalculateDesiredRenderSize(const FBox2D& screen_rect, unsigned int depth, const FVector2D& viewport_size);
+
+   // Power of two on each axis, but never bigger than the viewport
+   static FIntPoint QuantizeRenderSize(const FVector2D& size, const FVector2D& viewport_size);
+
+   // Check if size is far enough from the power of two bucket_size to move to another bucket
+   static bool IsOutsideHysteresisBand(float size, int32 bucket_size);
+
    // --------------------------- //
 
    APortal* m_owner = nullptr;
@@ -107,9 +168,19 @@ protected:
 
    bool m_is_total_reflection = false;
 
-   int32 CachedRenderSize = 0;
+   UTextureRenderTarget2D* m_render_target;
 
-   float LastDistanceToCamera = 0.0f;
+   // Render target of the new size, used instead of m_render_target once created on the render thread
+   UPROPERTY(Transient)
+   UTextureRenderTarget2D* m_pending_render_target = nullptr;
 
-   UTextureRenderTarget2D* m_render_target;
+   uint64 m_pending_render_target_frame = 0;
+
+   // bEnableClipPlane is turned off while the clip plane is part of the projection
+   bool m_is_clip_plane_in_projection = false;
+
+   // Rooms and revisions ShowOnlyActors was built from, 0 without room
+   uint32 m_rooms_hash = 0;
+
+   uint32 m_capture_count = 0;
 };
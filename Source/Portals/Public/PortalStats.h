@@ -0,0 +1,37 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Stats/Stats.h"
+
+// Displayed with "stat portals". The GPU time of the captures is not part of it nor of "stat gpu" yet,
+// only profilegpu shows it, under the ProfilingEventName of each UPortalSceneCapture
+DECLARE_STATS_GROUP(TEXT("Portals"), STATGROUP_Portals, STATCAT_Advanced);
+
+// ---- Cycle counters ---- //
+
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Update visible portals"), STAT_PortalUpdateVisiblePortals, STATGROUP_Portals, PORTALS_API);
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Build render tree"), STAT_PortalBuildRenderTree, STATGROUP_Portals, PORTALS_API);
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Render tree"), STAT_PortalRenderTree, STATGROUP_Portals, PORTALS_API);
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Visibility test"), STAT_PortalVisibilityTest, STATGROUP_Portals, PORTALS_API);
+DECLARE_CYCLE_STAT_EXTERN(TEXT("SceneCapture update"), STAT_PortalSceneCaptureUpdate, STATGROUP_Portals, PORTALS_API);
+DECLARE_CYCLE_STAT_EXTERN(TEXT("SceneCapture capture"), STAT_PortalCaptureScene, STATGROUP_Portals, PORTALS_API);
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Update portal texture"), STAT_PortalUpdateTexture, STATGROUP_Portals, PORTALS_API);
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Update crossings"), STAT_PortalUpdateCrossings, STATGROUP_Portals, PORTALS_API);
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Update streaming"), STAT_PortalUpdateStreaming, STATGROUP_Portals, PORTALS_API);
+
+// ---- Counters ---- //
+
+DECLARE_DWORD_COUNTER_STAT_EXTERN(TEXT("Portals visible"), STAT_PortalsVisible, STATGROUP_Portals, PORTALS_API);
+DECLARE_DWORD_COUNTER_STAT_EXTERN(TEXT("Captures"), STAT_PortalCaptures, STATGROUP_Portals, PORTALS_API);
+DECLARE_DWORD_COUNTER_STAT_EXTERN(TEXT("Max depth reached"), STAT_PortalMaxDepth, STATGROUP_Portals, PORTALS_API);
+DECLARE_DWORD_COUNTER_STAT_EXTERN(TEXT("Line traces"), STAT_PortalLineTraces, STATGROUP_Portals, PORTALS_API);
+DECLARE_DWORD_COUNTER_STAT_EXTERN(TEXT("Texture copies"), STAT_PortalTextureCopies, STATGROUP_Portals, PORTALS_API);
+DECLARE_DWORD_COUNTER_STAT_EXTERN(TEXT("Teleports"), STAT_PortalTeleports, STATGROUP_Portals, PORTALS_API);
+DECLARE_DWORD_COUNTER_STAT_EXTERN(TEXT("Shared captures"), STAT_PortalSharedCaptures, STATGROUP_Portals, PORTALS_API);
+DECLARE_DWORD_COUNTER_STAT_EXTERN(TEXT("Streamed destinations"), STAT_PortalStreamingDestinations, STATGROUP_Portals, PORTALS_API);
+
+// Leased render targets, and the ones waiting in the pool to be leased again
+DECLARE_MEMORY_STAT_EXTERN(TEXT("Render targets"), STAT_PortalRenderTargetMemory, STATGROUP_Portals, PORTALS_API);
+DECLARE_MEMORY_STAT_EXTERN(TEXT("Free render targets"), STAT_PortalFreeRenderTargetMemory, STATGROUP_Portals, PORTALS_API);
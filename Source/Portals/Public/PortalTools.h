@@ -12,6 +12,7 @@ class AController;
 class UPortalSceneCapture;
 struct FHitResult;
 struct FCollisionQueryParams;
+struct FConvexVolume;
 
 // Utility class
 class PORTALS_API Tools
@@ -28,6 +29,43 @@ public:
 
    static bool isPortalVisibleToCamera(APortal* portal, USceneComponent* camera, float near_plane_distance = 0.f);
 
+   // Check if the portal is close enough, facing the camera and inside its frustum, without any line trace
+   static bool isPortalInCameraView(APortal* portal, USceneComponent* camera, float near_plane_distance = 0.f);
+
+   // Frustum of a camera or SceneCapture component, returns false for any other component
+   static bool ComputeCameraFrustum(USceneComponent* camera, float near_plane_distance, FConvexVolume& OUT_frustum);
+
+   // Check with line traces if every vertex of the portal is hidden to the camera
+   static bool isPortalOccluded(APortal* portal, USceneComponent* camera);
+
+   // When a vertex is hidden by an impact closer than this, the portal is probably embedded in a wall and thus visible
+   // From r.Portals.EmbeddedDistance, or the project settings if negative
+   static float GetEmbeddedPortalDistance();
+
+   // Parameters of the line traces testing the visibility of the vertices of the portal from the camera, built once for all the vertices
+   static FCollisionQueryParams GetVertexTraceParams(APortal* portal, USceneComponent* camera);
+
+   // Trace from the SceneCapture to the vertex through its linked portal, returns false if the ray doesn't go through it
+   // OUT_start is set to the point where the ray leaves the linked portal
+   static bool TraceThroughLinkedPortal(FVector& OUT_start, UPortalSceneCapture* scene_capture, const FVector& vertex, const FCollisionQueryParams& params);
+
+   // Get the view matrix of a camera placed at view_transform
+   static FMatrix ComputeViewMatrix(const FTransform& view_transform);
+
+   // Get the part of the screen covered by the portal, in normalized device coordinates ([-1;1]x[-1;1])
+   // Returns false if the portal is not on screen
+   static bool ComputePortalScreenRect(const APortal* portal, const FTransform& view_transform, const FMatrix& projection_matrix, FBox2D& OUT_screen_rect);
+
+   // Matrix applied after a projection so that screen_rect (normalized device coordinates) covers the whole screen
+   static FMatrix ComputeCropMatrix(const FBox2D& screen_rect);
+
+   // Replace the near plane of a perspective projection by the clip plane, in world space and keeping its positive side
+   // Returns false if the camera is on the kept side of the plane, or the projection is not a reversed Z perspective one
+   static bool ComputeObliqueProjectionMatrix(const FMatrix& projection_matrix, const FMatrix& view_matrix, const FPlane& clip_plane, FMatrix& OUT_projection_matrix);
+
+   // Get the fraction of the screen covered by the portal : [0;1]
+   static float ComputePortalScreenCoverage(const APortal* portal, const FTransform& view_transform, const FMatrix& projection_matrix);
+
    UFUNCTION(BlueprintCallable)
    static bool IsPointInsideBox(FVector point, UBoxComponent* box);
 
@@ -39,7 +77,7 @@ public:
    static float ComputeRefractionAngle(float incidence_angle, float n1, float n2);
 
 private:
-   static bool IsVertexHidden(FHitResult& OUT_hit_result, USceneComponent* camera, const FVector& vertex, FCollisionQueryParams& params);
+   static bool IsVertexHidden(FHitResult& OUT_hit_result, USceneComponent* camera, const FVector& vertex, const FCollisionQueryParams& params);
    
    static bool isActorInCameraViewFrustum(AActor* actor, USceneComponent* camera, float near_plane_distance = 0.f);
 
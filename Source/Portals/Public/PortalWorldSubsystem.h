@@ -0,0 +1,62 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Engine/EngineBaseTypes.h"
+#include "Subsystems/WorldSubsystem.h"
+#include "PortalWorldSubsystem.generated.h"
+
+class APortalManager;
+class UPortalWorldSubsystem;
+
+
+// Updates the portals of the world once per frame
+USTRUCT()
+struct FPortalTickFunction : public FTickFunction
+{
+   GENERATED_BODY()
+
+   UPortalWorldSubsystem* subsystem = nullptr;
+
+   virtual void ExecuteTick(float DeltaTime, ELevelTick TickType, ENamedThreads::Type CurrentThread, const FGraphEventRef& MyCompletionGraphEvent) override;
+
+   virtual FString DiagnosticMessage() override { return TEXT("FPortalTickFunction"); }
+};
+
+
+template<>
+struct TStructOpsTypeTraits<FPortalTickFunction> : public TStructOpsTypeTraitsBase2<FPortalTickFunction>
+{
+   enum { WithCopy = false };
+};
+
+
+// Runs the teleports, visibility and captures of the portals in TG_PostUpdateWork, once the gameplay and the player cameras are updated
+// Neither the manager nor the portals need to tick for that
+UCLASS()
+class PORTALS_API UPortalWorldSubsystem : public UWorldSubsystem
+{
+   GENERATED_BODY()
+
+public:
+   virtual void OnWorldBeginPlay(UWorld& world) override;
+
+   virtual void Deinitialize() override;
+
+   // The manager updating the portals of the world, set by the manager itself
+   void SetPortalManager(APortalManager* portal_manager) { m_portal_manager = portal_manager; }
+
+   APortalManager* GetPortalManager() const { return m_portal_manager; }
+
+   void Tick(float DeltaSeconds);
+
+protected:
+   virtual bool DoesSupportWorldType(EWorldType::Type world_type) const override;
+
+private:
+   UPROPERTY(Transient)
+   APortalManager* m_portal_manager = nullptr;
+
+   FPortalTickFunction m_tick_function;
+};
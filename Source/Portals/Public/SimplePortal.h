@@ -15,9 +15,13 @@ class PORTALS_API ASimplePortal : public APortal
 public:
    virtual void SetSceneCaptures() override;
 
+   // Only taken into account if called before the portal is registered, e.g. on a deferred spawn
+   void SetLink(ECameraType type, APortal* linked_portal, bool exit_in_front = false);
+
 
 protected:
-   virtual void BeginPlay() override;
+   // Default link set before BeginPlay, where APortal registers to the manager and creates the SceneCaptures from it
+   virtual void PostInitializeComponents() override;
 
    UFUNCTION(BlueprintPure)
    bool IsMirror() const { return m_type == ECameraType::Mirror; }
@@ -6,6 +6,8 @@
 #include "Portal.h"
 #include "TeleporterPortal.generated.h"
 
+class UBoxComponent;
+class UPrimitiveComponent;
 class UPortalSceneCapture;
 
 UCLASS()
@@ -16,21 +18,53 @@ class PORTALS_API ATeleporterPortal : public APortal
 public:
    virtual void SetSceneCaptures() override;
 
+   // Only taken into account if called before the portal is registered, e.g. on a deferred spawn
+   void SetLinkedPortal(APortal* linked_portal, bool exit_in_front = false);
+
    UFUNCTION(BlueprintCallable, Category = "|Portal")
    bool IsPointInFrontOfPortal(FVector point) const;
 
+   // Always false with the native crossing detection, for Blueprint teleports not to teleport the tracked actors a second time
    UFUNCTION(BlueprintCallable, Category = "|Portal")
    bool IsCrossingPortal(FVector point);
 
    UFUNCTION(BlueprintCallable, Category = "|Portal")
    void TeleportActor(AActor* actor_to_teleport);
+
+   // Store in OUT_crossing_actors the tracked actors which went through the portal since the last call, called once per tick by the manager
+   void UpdateCrossings(TArray<AActor*>& OUT_crossing_actors);
+
+   bool HasTrackedActors() const { return m_tracked_actors.Num() > 0; }
 	
 protected:
+   // Default link set before BeginPlay, where APortal registers to the manager and creates the SceneCaptures from it
+   virtual void PostInitializeComponents() override;
+
    virtual void BeginPlay() override;
 
    UFUNCTION(BlueprintCallable)
    void ResetLastInFront() { m_last_in_front = false; }
 
+   UFUNCTION()
+   void OnCrossingBoxBeginOverlap(UPrimitiveComponent* overlapped_component, AActor* other_actor, UPrimitiveComponent* other_component, int32 other_body_index, bool from_sweep, const FHitResult& sweep_result);
+
+   UFUNCTION()
+   void OnCrossingBoxEndOverlap(UPrimitiveComponent* overlapped_component, AActor* other_actor, UPrimitiveComponent* other_component, int32 other_body_index);
+
+   void StartTracking(AActor* actor);
+
+   // Forget the last point of the actor if it is tracked, for a teleport not to be seen as a crossing
+   void RestartTracking(const AActor* actor);
+
+   // Point whose movement is tested against the portal plane, the camera of the characters for them not to see behind the portal
+   static FVector GetTrackedPoint(const AActor* actor);
+
+   // Check if the segment crosses the portal plane from front to back inside the crossing box
+   bool IsSegmentCrossingPortal(const FVector& start, const FVector& end) const;
+
+   // Velocity of something leaving the linked portal that had the given velocity when entering this one
+   FVector ComputeExitVelocity(const FVector& velocity) const;
+
    // ------------------------------------- //
 
    UPROPERTY(EditAnywhere, Category = "Portal", DisplayName = "Exit in front of linked portal")
@@ -39,6 +73,18 @@ protected:
    UPROPERTY(EditAnywhere, Category = "Portal", DisplayName = "Linked portal")
    APortal* m_linked_portal;
 
-   // Used for tracking movement
+   // Actors overlapping it are tracked and teleported natively when crossing the portal. Its X extent should cover the distance they move in a frame
+   UPROPERTY(VisibleAnywhere, Category = "Portal|Teleport")
+   UBoxComponent* m_crossing_box;
+
+   // Disable to handle the teleports in Blueprint with IsCrossingPortal, which then needs the actor tick
+   UPROPERTY(EditAnywhere, Category = "Portal|Teleport", DisplayName = "Native crossing detection")
+   bool m_is_native_crossing_enabled = true;
+
+   // Tracked actors and the point they were at on the last update, at the same index
+   TArray<TWeakObjectPtr<AActor>> m_tracked_actors;
+   TArray<FVector> m_tracked_points;
+
+   // Used for tracking movement in Blueprint, a single object at a time
    bool m_last_in_front;
 };